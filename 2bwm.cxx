@@ -21,15 +21,24 @@
 #include <X11/keysym.h>
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <functional>
+#include <iterator>
 #include <list>
 #include <memory>
+#include <optional>
+#include <span>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <vector>
 #include <xcb/randr.h>
+#include <xcb/sync.h>
 #include <xcb/xcb_ewmh.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_keysyms.h>
@@ -39,6 +48,7 @@ struct Monitor {
 	xcb_randr_output_t id;
 	int16_t x, y;
 	uint16_t width, height;
+	uint32_t refresh{0}; // Of the mode it shows in mHz, 0 if unknown.
 	// Constructor ersetzt addmonitor, das das neue Objekt am Anfang einer linked list erstellt.
 	Monitor(xcb_randr_output_t id, const int16_t x, const int16_t y, const uint16_t width,
 		const uint16_t height)
@@ -83,9 +93,37 @@ struct Sizepos {
 	uint16_t width, height;
 };
 
+/* Everything a border is painted from, so it is only repainted when one of these changes. */
+struct Borderkey {
+	uint16_t width{0}, height{0};
+	uint8_t depth{0};
+	bool focused{false}, fixed{false}, unkillable{false}, top{false};
+	bool operator==(const Borderkey&) const = default;
+};
+
+/* A pixmap the border of a client is tiled with, and what it was painted for. */
+struct Bordertile {
+	xcb_pixmap_t pmap{XCB_NONE};
+	uint16_t width{0}, height{0}; // At least the window's size with its border.
+	Borderkey key;
+};
+
+/* Names a slot of the client pool together with the generation the slot had
+ * when the client was created, so a handle to a forgotten client goes stale
+ * instead of pointing at whatever reuses the slot. */
+struct Clienthandle {
+	uint32_t index{UINT32_MAX};
+	uint32_t gen{0};
+	bool operator==(const Clienthandle&) const = default;
+};
+
+// Stacking layers, a window is never below one of a lower layer.
+enum { LAYER_BELOW, LAYER_NORMAL, LAYER_ABOVE, LAYER_FULLSCREEN };
+
 class Client { // Everything we know about a window.
       public:
 	xcb_drawable_t id;            // ID of this window.
+	Clienthandle handle;          // Our slot in the client pool.
 	bool usercoord{false};        // X,Y was set by -geom.
 	int16_t x{0}, y{0};           // X/Y coordinate.
 	uint16_t width{0}, height{0}; // Width,Height in pixels.
@@ -96,7 +134,19 @@ class Client { // Everything we know about a window.
 	bool fixed{false}, unkillable{false}, vertmaxed{false}, hormaxed{false}, maxed{false},
 		verthor{false}, ignore_borders{false}, iconic{false};
 	Monitor* monitor{nullptr}; // The physical output this window is on.
-	// std::list<Client*>* wsitem; // Pointer to workspace window list.
+	Client *ws_prev{nullptr}, *ws_next{nullptr}; // Links in our workspace list.
+	uint8_t dirty{0};         // What commit() still has to write, DIRTY_* bits.
+	bool focusborder{false};  // Paint the border in the focus colour.
+	Sizepos sent{0, 0, 0, 0}; // Geometry the server last got from us.
+	Borderkey painted;        // What the border shows now.
+	std::array<Bordertile, 2> bordertiles; // One per colour it switches between.
+	uint8_t bordershown{0};   // The tile set as the border, the other one is free to paint.
+	uint8_t layer{LAYER_NORMAL}; // Layer asked for, fullscreen windows go above it.
+	bool isfullscreen{false};    // Maxed over the whole monitor.
+	xcb_sync_alarm_t syncalarm{XCB_NONE}; // Fires when it drew the size we asked for.
+	int64_t syncvalue{0};                 // The value its counter reaches then.
+	bool syncwait{false};                 // Sizes wait until it fires, or until
+	std::chrono::steady_clock::time_point syncsent; // sync_timeout after this.
 	size_t ws{SIZE_MAX}; // In which workspace this window belongs to.
 	bool operator==(const Client& b) const
 	{
@@ -133,6 +183,499 @@ class Client { // Everything we know about a window.
 	}
 };
 
+/* Intrusive list of the clients on one workspace, threaded through
+ * Client::ws_prev and Client::ws_next. Adding and removing never allocates. */
+class Wslist {
+	Client *head{nullptr}, *tail{nullptr};
+	size_t count{0};
+
+      public:
+	class iterator {
+		Client* cl;
+
+	      public:
+		iterator(Client* cl) : cl{cl} {}
+		auto operator*() const -> Client*
+		{
+			return cl;
+		}
+		auto operator++() -> iterator&
+		{
+			cl = cl->ws_next;
+			return *this;
+		}
+		bool operator==(const iterator&) const = default;
+	};
+
+	void push_back(Client* client)
+	{
+		client->ws_prev = tail;
+		client->ws_next = nullptr;
+		(tail ? tail->ws_next : head) = client;
+		tail = client;
+		count++;
+	}
+
+	void remove(Client* client)
+	{
+		(client->ws_prev ? client->ws_prev->ws_next : head) = client->ws_next;
+		(client->ws_next ? client->ws_next->ws_prev : tail) = client->ws_prev;
+		client->ws_prev = client->ws_next = nullptr;
+		count--;
+	}
+
+	void clear()
+	{
+		while (head) remove(head);
+	}
+
+	auto empty() const -> bool
+	{
+		return head == nullptr;
+	}
+	auto size() const -> size_t
+	{
+		return count;
+	}
+	auto front() const -> Client*
+	{
+		return head;
+	}
+	auto back() const -> Client*
+	{
+		return tail;
+	}
+	auto begin() const -> iterator
+	{
+		return {head};
+	}
+	auto end() const -> iterator
+	{
+		return {nullptr};
+	}
+};
+
+/* Slab allocator for client records. Slots live in fixed size chunks that
+ * never move, so a Client* stays valid for as long as the client is managed.
+ * Freed slots are kept on a free list and reused before a new chunk is
+ * allocated, and iteration walks the chunks in order. */
+class Clientpool {
+	static constexpr uint32_t CHUNK{64};
+	struct Slot {
+		std::optional<Client> client;
+		uint32_t gen{0};
+		uint32_t next_free{UINT32_MAX};
+	};
+	std::vector<std::unique_ptr<std::array<Slot, CHUNK>>> chunks;
+	uint32_t free_head{UINT32_MAX};
+
+	auto slot(uint32_t index) const -> Slot&
+	{
+		return (*chunks[index / CHUNK])[index % CHUNK];
+	}
+
+	auto capacity() const -> uint32_t
+	{
+		return chunks.size() * CHUNK;
+	}
+
+	void grow()
+	{
+		auto base = capacity();
+		chunks.push_back(std::make_unique<std::array<Slot, CHUNK>>());
+		for (auto i = CHUNK; i-- > 0;) {
+			slot(base + i).next_free = free_head;
+			free_head = base + i;
+		}
+	}
+
+      public:
+	class iterator {
+		const Clientpool* pool;
+		uint32_t index;
+
+		void skip()
+		{
+			while (index < pool->capacity() && !pool->slot(index).client) index++;
+		}
+
+	      public:
+		iterator(const Clientpool* pool, uint32_t index) : pool{pool}, index{index}
+		{
+			skip();
+		}
+		auto operator*() const -> Client&
+		{
+			return *pool->slot(index).client;
+		}
+		auto operator++() -> iterator&
+		{
+			index++;
+			skip();
+			return *this;
+		}
+		bool operator==(const iterator&) const = default;
+	};
+
+	template <typename... Args>
+	auto emplace(Args&&... args) -> Client*
+	{
+		if (free_head == UINT32_MAX) grow();
+		auto index = free_head;
+		auto& s = slot(index);
+		free_head = s.next_free;
+		auto& client = s.client.emplace(std::forward<Args>(args)...);
+		client.handle = {index, s.gen};
+		return &client;
+	}
+
+	auto get(Clienthandle handle) const -> Client*
+	{
+		if (handle.index >= capacity()) return nullptr;
+		auto& s = slot(handle.index);
+		return (s.client && s.gen == handle.gen) ? &*s.client : nullptr;
+	}
+
+	void erase(Clienthandle handle)
+	{
+		if (get(handle) == nullptr) return;
+		auto& s = slot(handle.index);
+		s.client.reset();
+		s.gen++;
+		s.next_free = free_head;
+		free_head = handle.index;
+	}
+
+	// Forget all clients but keep the chunks around for reuse.
+	void clear()
+	{
+		for (auto& client : *this) erase(client.handle);
+	}
+
+	auto begin() const -> iterator
+	{
+		return {this, 0};
+	}
+	auto end() const -> iterator
+	{
+		return {this, capacity()};
+	}
+};
+
+/* Open addressing hash index from window id to client. Linear probing with
+ * backward shift deletion, so a lookup never has to step over tombstones. */
+class Winindex {
+      public:
+	auto find(xcb_window_t win) const -> Clienthandle
+	{
+		if (slots.empty() || XCB_NONE == win) return {};
+		for (auto i = home(win);; i = (i + 1) & mask()) {
+			if (slots[i].win == win) return slots[i].client;
+			if (slots[i].win == XCB_NONE) return {};
+		}
+	}
+
+	void insert(xcb_window_t win, Clienthandle client)
+	{
+		if (XCB_NONE == win) return;
+		// Keep the load factor below one half.
+		if ((used + 1) * 2 > slots.size()) grow();
+		auto i = home(win);
+		while (slots[i].win != XCB_NONE && slots[i].win != win) i = (i + 1) & mask();
+		if (slots[i].win == XCB_NONE) used++;
+		slots[i] = {win, client};
+	}
+
+	void erase(xcb_window_t win)
+	{
+		if (slots.empty() || XCB_NONE == win) return;
+		auto i = home(win);
+		while (slots[i].win != win) {
+			if (slots[i].win == XCB_NONE) return;
+			i = (i + 1) & mask();
+		}
+		// Pull back every entry of the cluster that would become unreachable.
+		for (auto j = (i + 1) & mask(); slots[j].win != XCB_NONE; j = (j + 1) & mask()) {
+			auto k = home(slots[j].win);
+			if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+			slots[i] = slots[j];
+			i = j;
+		}
+		slots[i] = {};
+		used--;
+	}
+
+	void clear()
+	{
+		slots.clear();
+		used = 0;
+	}
+
+      private:
+	struct Slot {
+		xcb_window_t win{XCB_NONE};
+		Clienthandle client;
+	};
+	std::vector<Slot> slots;
+	size_t used{0};
+
+	auto mask() const -> size_t
+	{
+		return slots.size() - 1;
+	}
+
+	// Window ids are mostly sequential, so spread them with Fibonacci hashing.
+	auto home(xcb_window_t win) const -> size_t
+	{
+		return ((win * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask();
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old(slots.empty() ? 64 : slots.size() * 2);
+		old.swap(slots);
+		used = 0;
+		for (auto const& slot : old)
+			if (slot.win != XCB_NONE) insert(slot.win, slot.client);
+	}
+};
+
+/* Compressed grid over the monitor rectangles. The distinct left/right and
+ * top/bottom edges of all outputs cut the screen into cells, each knowing the
+ * monitor that covers it. For every monitor the grid also keeps running sums
+ * of the area it covers, and of its widths along each row and heights along
+ * each column. A rectangle only cuts into the cells of its first and last row
+ * and column, so the area each monitor has under it comes from a few of those
+ * sums: a query costs four binary searches and constant work per monitor,
+ * however many cells the rectangle spans. */
+class Monindex {
+	std::vector<Monitor*> mons;    // Numbered in the order of monlist.
+	std::vector<int32_t> xs, ys;   // Sorted distinct edges.
+	std::vector<size_t> owner;     // Row major, number of the monitor on each cell.
+	std::vector<int64_t> areas;    // Per monitor, its area above and left of each corner.
+	std::vector<int64_t> rowsums;  // Per monitor and row, its width left of each edge.
+	std::vector<int64_t> colsums;  // Per monitor and column, its height above each edge.
+
+	auto cols() const -> size_t
+	{
+		return xs.size() - 1;
+	}
+
+	auto rows() const -> size_t
+	{
+		return ys.size() - 1;
+	}
+
+	auto areaat(size_t m, size_t j, size_t i) const -> size_t
+	{
+		return (m * (rows() + 1) + j) * (cols() + 1) + i;
+	}
+
+	auto rowat(size_t m, size_t j, size_t i) const -> size_t
+	{
+		return (m * rows() + j) * (cols() + 1) + i;
+	}
+
+	auto colat(size_t m, size_t i, size_t j) const -> size_t
+	{
+		return (m * cols() + i) * (rows() + 1) + j;
+	}
+
+	// Area of monitor m in the cells of rows [j0, j1) and columns [i0, i1).
+	auto blockarea(size_t m, size_t j0, size_t j1, size_t i0, size_t i1) const -> int64_t
+	{
+		if (j0 >= j1 || i0 >= i1) return 0;
+		return areas[areaat(m, j1, i1)] - areas[areaat(m, j0, i1)] -
+		       areas[areaat(m, j1, i0)] + areas[areaat(m, j0, i0)];
+	}
+
+	// Width of monitor m in row j, columns [i0, i1).
+	auto rowwidth(size_t m, size_t j, size_t i0, size_t i1) const -> int64_t
+	{
+		return i0 < i1 ? rowsums[rowat(m, j, i1)] - rowsums[rowat(m, j, i0)] : 0;
+	}
+
+	// Height of monitor m in column i, rows [j0, j1).
+	auto colheight(size_t m, size_t i, size_t j0, size_t j1) const -> int64_t
+	{
+		return j0 < j1 ? colsums[colat(m, i, j1)] - colsums[colat(m, i, j0)] : 0;
+	}
+
+      public:
+	void rebuild(std::list<Monitor>& monlist)
+	{
+		mons.clear();
+		xs.clear();
+		ys.clear();
+		if (monlist.empty()) return;
+
+		for (auto& mon : monlist) {
+			mons.push_back(&mon);
+			xs.insert(xs.end(), {mon.x, mon.x + mon.width});
+			ys.insert(ys.end(), {mon.y, mon.y + mon.height});
+		}
+		for (auto edges : {&xs, &ys}) {
+			std::sort(edges->begin(), edges->end());
+			edges->erase(std::unique(edges->begin(), edges->end()), edges->end());
+		}
+
+		owner.assign(cols() * rows(), SIZE_MAX);
+		for (size_t j = 0; j < rows(); j++)
+			for (size_t i = 0; i < cols(); i++)
+				for (size_t m = 0; m < mons.size(); m++) {
+					auto const* mon = mons[m];
+					if (mon->x <= xs[i] && xs[i] < mon->x + mon->width &&
+					    mon->y <= ys[j] && ys[j] < mon->y + mon->height) {
+						owner[j * cols() + i] = m;
+						break;
+					}
+				}
+
+		areas.assign(mons.size() * (rows() + 1) * (cols() + 1), 0);
+		rowsums.assign(mons.size() * rows() * (cols() + 1), 0);
+		colsums.assign(mons.size() * cols() * (rows() + 1), 0);
+		for (size_t m = 0; m < mons.size(); m++)
+			for (size_t j = 0; j < rows(); j++)
+				for (size_t i = 0; i < cols(); i++) {
+					bool const mine = owner[j * cols() + i] == m;
+					int64_t const w = mine ? xs[i + 1] - xs[i] : 0;
+					int64_t const h = mine ? ys[j + 1] - ys[j] : 0;
+					auto& a = areas;
+					a[areaat(m, j + 1, i + 1)] = a[areaat(m, j, i + 1)] +
+								     a[areaat(m, j + 1, i)] -
+								     a[areaat(m, j, i)] + w * h;
+					rowsums[rowat(m, j, i + 1)] = rowsums[rowat(m, j, i)] + w;
+					colsums[colat(m, i, j + 1)] = colsums[colat(m, i, j)] + h;
+				}
+	}
+
+	// Monitor covering the largest part of the rectangle or nullptr.
+	auto bestfit(int32_t x, int32_t y, int32_t width, int32_t height) const -> Monitor*
+	{
+		if (mons.empty()) return nullptr;
+
+		int32_t const x0 = std::max(x, xs.front());
+		int32_t const x1 = std::min(x + std::max(width, 1), xs.back());
+		int32_t const y0 = std::max(y, ys.front());
+		int32_t const y1 = std::min(y + std::max(height, 1), ys.back());
+		if (x0 >= x1 || y0 >= y1) return nullptr;
+
+		auto cell = [](std::vector<int32_t> const& edges, int32_t v) -> size_t {
+			return std::upper_bound(edges.begin(), edges.end(), v) - edges.begin() - 1;
+		};
+		/* Its first and last column and row, the only ones it may cut into. */
+		std::array<size_t, 2> const is{cell(xs, x0), cell(xs, x1 - 1)};
+		std::array<size_t, 2> const js{cell(ys, y0), cell(ys, y1 - 1)};
+		size_t const ni = is[0] == is[1] ? 1 : 2, nj = js[0] == js[1] ? 1 : 2;
+		auto wx = [&](size_t i) -> int64_t {
+			return std::min(xs[i + 1], x1) - std::max(xs[i], x0);
+		};
+		auto hy = [&](size_t j) -> int64_t {
+			return std::min(ys[j + 1], y1) - std::max(ys[j], y0);
+		};
+
+		Monitor* best = nullptr;
+		int64_t bestarea = 0;
+		for (size_t m = 0; m < mons.size(); m++) {
+			/* The cells it covers whole, then the ones it cuts into. */
+			auto sum = blockarea(m, js[0] + 1, js[1], is[0] + 1, is[1]);
+			for (size_t b = 0; b < nj; b++) {
+				sum += hy(js[b]) * rowwidth(m, js[b], is[0] + 1, is[1]);
+				for (size_t a = 0; a < ni; a++)
+					if (owner[js[b] * cols() + is[a]] == m)
+						sum += wx(is[a]) * hy(js[b]);
+			}
+			for (size_t a = 0; a < ni; a++)
+				sum += wx(is[a]) * colheight(m, is[a], js[0] + 1, js[1]);
+
+			if (sum > bestarea) {
+				best = mons[m];
+				bestarea = sum;
+			}
+		}
+		return best;
+	}
+};
+
+/* Edges of the windows on a workspace, sorted along their axis (sweep and
+ * prune style). Built once when a drag starts, so snapping only has to look
+ * at the edges within magnet distance of the dragged window. Keys already
+ * include the border, so they compare directly with the dragged window's
+ * coordinates. */
+class Snapindex {
+	struct Edge {
+		int32_t key;    // Coordinate the dragged window's edge is compared with.
+		int32_t lo, hi; // Extent of the window along the other axis.
+		bool operator<(const Edge& b) const
+		{
+			return key < b.key;
+		}
+	};
+	// Right and bottom edges snap our left and top side, left and top edges
+	// snap our right and bottom side.
+	std::vector<Edge> right, bottom, left, top;
+
+	/* Closest edge with |key - v| < range that overlaps lo,hi on the other
+	 * axis, or nullptr. */
+	static auto nearest(std::vector<Edge> const& edges, int32_t v, int32_t range, int32_t lo,
+			    int32_t hi) -> Edge const*
+	{
+		Edge const* best = nullptr;
+		auto first = std::lower_bound(edges.begin(), edges.end(), Edge{v - range + 1, 0, 0});
+		for (auto e = first; e != edges.end() && e->key < v + range; e++)
+			if (hi > e->lo && lo < e->hi &&
+			    (nullptr == best || abs(e->key - v) < abs(best->key - v)))
+				best = &*e;
+		return best;
+	}
+
+      public:
+	void clear()
+	{
+		for (auto edges : {&right, &bottom, &left, &top}) edges->clear();
+	}
+
+	void add(Client const* win, int32_t bw)
+	{
+		right.push_back({win->x + win->width + bw, win->y, win->y + win->height});
+		bottom.push_back({win->y + win->height + bw, win->x, win->x + win->width});
+		left.push_back({win->x - bw, win->y, win->y + win->height});
+		top.push_back({win->y - bw, win->x, win->x + win->width});
+	}
+
+	void sort()
+	{
+		for (auto edges : {&right, &bottom, &left, &top})
+			std::sort(edges->begin(), edges->end());
+	}
+
+	/* Move client next to the closest edges within range. */
+	void snap(Client* client, int32_t range, int32_t bw) const
+	{
+		Edge const* e;
+
+		if ((e = nearest(right, client->x, range, client->y, client->y + client->height)))
+			client->x = e->key + bw;
+		else if ((e = nearest(left, client->x + client->width, range, client->y,
+				      client->y + client->height)))
+			client->x = e->key - bw - client->width;
+
+		if ((e = nearest(bottom, client->y, range, client->x, client->x + client->width)))
+			client->y = e->key + bw;
+		else if ((e = nearest(top, client->y + client->height, range, client->x,
+				      client->x + client->width)))
+			client->y = e->key - bw - client->height;
+	}
+};
+
+/* Everything setupwin() asks the server about a window. All requests are
+ * sent before waiting for the first reply, so setting up a window costs one
+ * round trip. */
+struct Wincookies {
+	xcb_get_property_cookie_t type, hints, transient, name, protocols, counter;
+	xcb_get_geometry_cookie_t geom;
+};
+
 struct Winconf {
 	int16_t x, y;
 	uint16_t width, height;
@@ -140,8 +683,32 @@ struct Winconf {
 	xcb_window_t sibling;
 };
 
+/* A move or resize with the pointer, carried on by run() between events. */
+struct Drag {
+	uint32_t mode;                  // TWOBWM_MOVE or TWOBWM_RESIZE.
+	Clienthandle client;            // The window, the drag is over when it goes.
+	int16_t mx, my;                 // Where the pointer started.
+	int16_t px, py;                 // Where it went since the last frame.
+	int16_t winx, winy;             // Where the window started.
+	uint16_t winw, winh;            // And its size.
+	int timer{-1};                  // Fires once a frame, -1 if drags aren't paced.
+	bool pending{false};            // The pointer moved since the last frame.
+	bool snapstale{true};           // Other windows changed, rebuild snapindex.
+	unsigned int frames{0}, dropped{0}; // For print_stats.
+	unsigned int throttled{0};          // Sizes held back while the client drew.
+};
+
 ///---Internal Constants---///
 static constexpr size_t WORKSPACES{10};
+// Workspace list index of fixed windows, which are shown on every workspace.
+static constexpr size_t FIXED_WS{WORKSPACES};
+
+/* Parts of a client that changed since they were last written to the server. */
+enum {
+	DIRTY_GEOMETRY = 1 << 0,
+	DIRTY_BORDER = 1 << 1,
+	DIRTY_CONFIGURE = 1 << 2 // The client waits for a ConfigureNotify, write it all.
+};
 
 static constexpr auto BUTTONMASK{XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE};
 
@@ -155,6 +722,107 @@ static constexpr auto TWOBWM_NOWS{0xfffffffe};
 	return mask & ~(numlockmask | XCB_MOD_MASK_LOCK);
 }
 
+[[nodiscard]] constexpr auto onworkspace(Client const* client, size_t ws) noexcept
+{
+	return client->ws == ws || client->ws == FIXED_WS;
+}
+
+///---Geometry constraints---///
+/* Everything that bounds the geometry of a client, so constrain() needs nothing from X. */
+struct Constraints {
+	Sizepos area;     // The monitor minus the offsets.
+	Sizepos full;     // The whole monitor.
+	uint16_t min_width, min_height, max_width, max_height; // 0 when there is no bound.
+	uint16_t width_inc, height_inc, base_width, base_height; // Sizes step by these.
+	uint8_t bw;       // Border width, 0 for windows that ignore borders.
+	uint8_t magnet;   // Pull windows this close to an edge of the area onto it.
+};
+
+struct Constrained {
+	Sizepos geom;
+	bool maximize;    // It covers a monitor: maximize it to geom instead.
+};
+
+/* Fit want inside the constraints in one pass: apply the size hints, shrink it to fit the area,
+ * move it inside and onto edges it is close to. A window as big as the monitor is maximized. */
+[[nodiscard]] constexpr auto constrain(Sizepos want, Constraints const& c) noexcept -> Constrained
+{
+	int32_t x = want.x, y = want.y, w = want.width, h = want.height;
+	int32_t const ax = c.area.x, ay = c.area.y, aw = c.area.width, ah = c.area.height;
+	int32_t const bw2 = c.bw * 2;
+
+	for (auto const& mon : {c.area, c.full})
+		if (w == mon.width && h == mon.height) return {mon, true};
+
+	if (c.width_inc > 1 && w > c.base_width) w -= (w - c.base_width) % c.width_inc;
+	if (c.height_inc > 1 && h > c.base_height) h -= (h - c.base_height) % c.height_inc;
+	if (0 != c.max_width) w = std::min<int32_t>(w, c.max_width);
+	if (0 != c.max_height) h = std::min<int32_t>(h, c.max_height);
+
+	/* Bring it back if it starts outside the area. */
+	if (x >= ax + aw) x = ax + aw - w - bw2;
+	if (y >= ay + ah) y = ay + ah - h - bw2;
+	x = std::max(x, ax);
+	y = std::max(y, ay);
+
+	/* Shrink it to end inside the area where it starts, but not below its minimum. */
+	if (x + w + bw2 > ax + aw) w = ax + aw - x - bw2;
+	if (y + h + bw2 > ay + ah) h = ay + ah - y - bw2;
+	w = std::max<int32_t>({w, c.min_width, 1});
+	h = std::max<int32_t>({h, c.min_height, 1});
+
+	/* Larger than the area: put it in the corner and shrink it. */
+	if (w + bw2 > aw) {
+		x = ax;
+		w = std::max(aw - bw2, 1);
+	}
+	if (h + bw2 > ah) {
+		y = ay;
+		h = std::max(ah - bw2, 1);
+	}
+
+	/* Inside the area, and onto the edges it is close to. */
+	if (x < ax + c.magnet)
+		x = ax;
+	else if (x + w + bw2 > ax + aw - c.magnet)
+		x = ax + aw - w - bw2;
+	if (y < ay + c.magnet)
+		y = ay;
+	else if (y + h + bw2 > ay + ah - c.magnet)
+		y = ay + ah - h - bw2;
+
+	return {{static_cast<int16_t>(x), static_cast<int16_t>(y), static_cast<uint16_t>(w),
+		 static_cast<uint16_t>(h)},
+		false};
+}
+
+#ifdef TWOBWM_TESTS
+/* Whether constrain() fits want to geom without maximizing it. */
+[[nodiscard]] constexpr auto constrainsto(Sizepos want, Constraints const& c, Sizepos geom) noexcept
+{
+	auto const got = constrain(want, c);
+	return !got.maximize && got.geom.x == geom.x && got.geom.y == geom.y &&
+	       got.geom.width == geom.width && got.geom.height == geom.height;
+}
+
+/* Size hints on a 1000x800 monitor with 2 pixel borders: increments count from the base size,
+ * sizes below the base are left alone, max bounds before min, and min wins over the area. */
+static constexpr Sizepos testmon{0, 0, 1000, 800};
+static_assert(constrainsto({100, 100, 307, 205}, {testmon, testmon, 0, 0, 0, 0, 10, 20, 2, 0, 2, 0},
+			   {100, 100, 302, 200}));
+static_assert(constrainsto({100, 100, 31, 27}, {testmon, testmon, 0, 0, 0, 0, 8, 8, 4, 6, 2, 0},
+			   {100, 100, 28, 22}));
+static_assert(constrainsto({100, 100, 3, 5}, {testmon, testmon, 0, 0, 0, 0, 8, 8, 4, 6, 2, 0},
+			   {100, 100, 3, 5}));
+static_assert(constrainsto({100, 100, 50, 900},
+			   {testmon, testmon, 200, 150, 400, 300, 0, 0, 0, 0, 2, 0},
+			   {100, 100, 200, 300}));
+static_assert(constrainsto({900, 100, 50, 50}, {testmon, testmon, 200, 0, 0, 0, 0, 0, 0, 0, 2, 0},
+			   {796, 100, 200, 50}));
+static_assert(constrain({5, 5, 1000, 800}, {testmon, testmon, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0})
+		      .maximize);
+#endif
+
 static constexpr auto CONTROL{XCB_MOD_MASK_CONTROL};
 static constexpr auto ALT{XCB_MOD_MASK_1};
 static constexpr auto SHIFT{XCB_MOD_MASK_SHIFT};
@@ -187,7 +855,7 @@ enum { TWOBWM_TELEPORT_CENTER_X,
        TWOBWM_TELEPORT_TOP_LEFT,
        TWOBWM_TELEPORT_CENTER_Y };
 enum { BOTTOM_RIGHT, BOTTOM_LEFT, TOP_RIGHT, TOP_LEFT, MIDDLE };
-enum { wm_delete_window, wm_change_state, NB_ATOMS };
+enum { wm_delete_window, wm_change_state, look_into, NB_ATOMS };
 enum { TWOBWM_RESIZE_KEEP_ASPECT_GROW, TWOBWM_RESIZE_KEEP_ASPECT_SHRINK };
 enum { TWOBWM_MAXIMIZE_HORIZONTALLY, TWOBWM_MAXIMIZE_VERTICALLY };
 enum { TWOBWM_MAXHALF_FOLD_HORIZONTAL,
@@ -224,20 +892,49 @@ void ewmh_deleter(xcb_ewmh_connection_t* e)
 std::unique_ptr<xcb_ewmh_connection_t, decltype(&ewmh_deleter)> ewmh{
 	nullptr, &ewmh_deleter};   // Ewmh Connection.
 xcb_screen_t* screen = nullptr;    // Our current screen.
+std::unique_ptr<xcb_key_symbols_t, decltype(&xcb_key_symbols_free)> keysyms{
+	nullptr, &xcb_key_symbols_free}; // Keyboard map, refreshed on MappingNotify.
 int randrbase = 0;                 // Beginning of RANDR extension events.
+static int syncbase = -1;          // Beginning of XSync events, -1 without it.
 static uint8_t curws = 0;          // Current workspace.
 Client* focuswin = nullptr;        // Current focus window.
-static xcb_drawable_t top_win = 0; // Window always on top.
-static std::list<Client> winlist;  // Global list of all client windows.
+static Clientpool winlist;         // Global list of all client windows.
+static Winindex winindex;          // Window id to client lookup for winlist.
 static std::list<Monitor> monlist; // List of all physical monitor outputs.
-static std::array<std::list<Client*>, WORKSPACES> wslists;
+static Monindex monindex;          // Spatial lookup for monlist.
+static Snapindex snapindex;        // Edges to snap to while moving focuswin.
+static unsigned int roundtrips = 0; // Replies we blocked on, for print_stats.
+static std::array<Wslist, WORKSPACES + 1> wslists; // The last one holds fixed windows.
+static std::vector<uint32_t> keygrabbed; // Root key grabs held, keycode << 16 | modifiers.
+static unsigned int mappingnotifies = 0;  // Keyboard changes not yet applied to the grabs.
+static std::vector<Clienthandle> dirtylist; // Clients with something left for commit().
+static std::vector<std::pair<xcb_window_t, bool>> restacklist; // Raises (true) and lowers.
+static std::vector<xcb_window_t> stacking; // Children of the root, the topmost last.
+static std::optional<std::vector<xcb_window_t>> clientlist_sent; // _NET_CLIENT_LIST.
+static bool clientlist_stale = true; // Stacking or the managed windows changed since.
+static bool restack_due = false; // Stacking changed, the layers may be out of order.
+static std::optional<xcb_window_t> activewin, activewin_sent; // _NET_ACTIVE_WINDOW.
+static unsigned int requests_asked = 0, requests_sent = 0; // Per commit(), for print_stats.
+static unsigned int repaints_skipped = 0; // Border repaints commit() found unneeded.
+static unsigned int resizes_throttled = 0; // Sizes commit() held back for clients drawing.
+static std::vector<xcb_generic_event_t*> batch; // Queued events run() handles in one go.
+static size_t batch_scope = 0; // First event of batch that later ones may be folded into.
+static unsigned int coalesced_configures = 0, coalesced_enters = 0; // For print_stats.
+static unsigned int overtaken = 0; // Events input was handled ahead of, for print_stats.
+static std::vector<std::pair<uint8_t, xcb_gcontext_t>> bordergcs; // One per window depth.
+static std::optional<Drag> drag; // The move or resize in progress.
+static std::optional<Client> preview; // Shows the size a resize is heading for.
+static std::array<xcb_cursor_t, 2> dragcursors; // Indexed by TWOBWM_MOVE and TWOBWM_RESIZE.
 
 ///---Global configuration.---///
-static const char* atomnames[NB_ATOMS][1] = {{"WM_DELETE_WINDOW"}, {"WM_CHANGE_STATE"}};
-xcb_atom_t ATOM[NB_ATOMS];
+xcb_atom_t ATOM[NB_ATOMS]; // Interned by setup(), names in atomnames.
 
 ///---Functions prototypes---///
 void run();
+void mergeconfigure(xcb_configure_request_event_t*, xcb_configure_request_event_t const*);
+void batchevent(xcb_generic_event_t*);
+auto holdsback(xcb_generic_event_t const*, std::array<xcb_window_t, 2> const&) -> bool;
+void schedule();
 auto setup(int) -> bool;
 void install_sig_handlers();
 void start(const Arg*);
@@ -265,6 +962,12 @@ void always_on_top();
 auto setup_keyboard() -> bool;
 auto setupscreen() -> bool;
 auto setuprandr() -> int;
+auto setupsync() -> int;
+void watchsync(Client*, xcb_sync_counter_t);
+void syncrequest(Client*);
+auto syncpending(Client const*) -> bool;
+auto syncdue() -> std::optional<std::chrono::steady_clock::time_point>;
+void syncnotify(xcb_generic_event_t*);
 void arrangewindows();
 void prevworkspace();
 void nextworkspace();
@@ -282,22 +985,28 @@ void clientmessage(xcb_generic_event_t*);
 void deletewin();
 void unkillable();
 void fix();
-void check_name(Client*);
-void addtoclientlist(const xcb_drawable_t);
+void check_name(Client*, xcb_get_property_cookie_t);
 void configurerequest(xcb_generic_event_t*);
 void buttonpress(xcb_generic_event_t*);
 void unmapnotify(xcb_generic_event_t*);
 void mapnotify(xcb_generic_event_t*);
 void destroynotify(xcb_generic_event_t*);
+void createnotify(xcb_generic_event_t*);
+void reparentnotify(xcb_generic_event_t*);
+void circulatenotify(xcb_generic_event_t*);
 void circulaterequest(xcb_generic_event_t*);
 void newwin(xcb_generic_event_t*);
 void handle_keypress(xcb_generic_event_t*);
-auto Create_Font_Cursor(xcb_connection_t*, uint16_t) -> xcb_cursor_t;
+auto Create_Font_Cursor(xcb_connection_t*, xcb_font_t, uint16_t) -> xcb_cursor_t;
+void create_back_win();
+void setupdrag();
 auto xcb_get_keycodes(xcb_keysym_t) -> xcb_keycode_t*;
 auto xcb_screen_of_display(xcb_connection_t*, int) -> xcb_screen_t*;
-auto setupwin(xcb_window_t) -> Client*;
+auto requestwin(xcb_window_t) -> Wincookies;
+auto setupwin(xcb_window_t, Wincookies const&) -> Client*;
 void cleanup();
-auto getwmdesktop(xcb_drawable_t) -> uint32_t;
+auto getwmdesktop(xcb_get_property_cookie_t) -> uint32_t;
+auto get_unkil_state(xcb_get_property_cookie_t) -> bool;
 void addtoworkspace(Client*, size_t);
 void grabbuttons(Client const*);
 void delfromworkspace(Client*);
@@ -306,40 +1015,163 @@ void fixwindow(Client*);
 void forgetclient(Client*);
 void forgetwin(xcb_window_t);
 void fitonscreen(Client*);
-void getoutputs(xcb_randr_output_t*, const int, xcb_timestamp_t);
+auto getconstraints(Client const*) -> Constraints;
+void getoutputs(xcb_randr_output_t*, const int, xcb_timestamp_t,
+		xcb_randr_get_screen_resources_current_reply_t*);
+auto refreshrate(xcb_randr_get_screen_resources_current_reply_t*, xcb_randr_mode_t) -> uint32_t;
+auto dragtimer(Monitor const*) -> int;
+auto dragevent(xcb_generic_event_t const*) -> bool;
+void dragframe();
+void stopdrag(xcb_generic_event_t const*);
+void snapchanged(Client const*);
+auto waitevent() -> xcb_generic_event_t*;
 auto findmonitor(xcb_randr_output_t) -> Monitor*;
 auto findclones(xcb_randr_output_t, const int16_t, const int16_t) -> Monitor*;
-auto findmonbycoord(const int16_t, const int16_t) -> Monitor*;
+auto findmonbyrect(Client const*) -> Monitor*;
+void updatemonitor(Client*);
 // static void delmonitor(Monitor*);
 void raisewindow(xcb_drawable_t);
+void lowerwindow(xcb_drawable_t);
+auto stacklayer(Client const*) -> uint8_t;
+auto inorder(std::vector<size_t> const&) -> std::vector<bool>;
+void restack();
+void stackbelow(xcb_window_t, xcb_window_t);
+void stackabove(xcb_window_t, xcb_window_t);
+void stackontop(xcb_window_t);
+void unstack(xcb_window_t);
+void writeclientlist();
+void markdirty(Client*, uint8_t);
+void commitclient(Client*);
+void commit();
 void movelim(Client*);
-void movewindow(xcb_drawable_t, const uint32_t, const uint32_t);
+void movewindow(Client*);
 auto findclient(const xcb_drawable_t*);
 void setfocus(Client const*);
 void resizelim(Client*);
-void resize(xcb_drawable_t, const uint16_t, const uint16_t);
-void moveresize(xcb_drawable_t, const uint16_t, const uint16_t, const uint16_t, const uint16_t);
-void mousemove(const int16_t, const int16_t);
+void resize(Client*);
+void moveresize(Client*);
+void mousemove(Client*, const int16_t, const int16_t);
 void mouseresize(Client*, const int16_t, const int16_t);
-void setborders(Client const*, const bool);
+void setborders(Client*, const bool);
+auto drawborders(Client*) -> bool;
+auto bordergc(uint8_t, xcb_drawable_t) -> xcb_gcontext_t;
+void painttile(Bordertile&, Borderkey const&, xcb_drawable_t);
 void unmax(Client*);
 auto getpointer(const xcb_drawable_t*, int16_t*, int16_t*) -> bool;
-auto getgeom(const xcb_drawable_t*, int16_t*, int16_t*, uint16_t*, uint16_t*, uint8_t*) -> bool;
 void configwin(xcb_window_t, uint16_t, const struct Winconf*);
 void sigcatch(const int);
 void ewmh_init();
-auto getatom(const char*) -> xcb_atom_t;
+void internatoms();
 void getmonsize(int8_t, int16_t*, int16_t*, uint16_t*, uint16_t*, const Client*);
 void movepointerback(const int16_t, const int16_t, const Client*);
 void snapwindow(Client*);
+void buildsnapindex(Client const*);
 
 [[nodiscard]] consteval auto getcolor(uint32_t hex) -> uint32_t
 {
 	return hex | 0xff000000;
 }
 
+/* Lets a command that takes no argument sit in keys[] without casting its type away. */
+template <void (*F)()> void noarg(const Arg* /*unused*/)
+{
+	F();
+}
+
 #include "config.hxx"
 
+/* Every atom we need besides the EWMH ones, in the order of the enum. */
+static constexpr const char* atomnames[]{"WM_DELETE_WINDOW", "WM_CHANGE_STATE", LOOK_INTO};
+static_assert(std::size(atomnames) == NB_ATOMS);
+
+///---Binding tables---///
+/* A binding is keyed on its keysym or button and its modifiers without the lock bits, which
+ * grabs and dispatch add and strip at runtime. */
+[[nodiscard]] constexpr auto bindkey(uint32_t sym, uint32_t mod) noexcept -> uint64_t
+{
+	return (uint64_t{sym} << 16) | (mod & ~XCB_MOD_MASK_LOCK & 0xffff);
+}
+
+/* Perfect hash over the bindings of config.hxx, searched for while compiling, so that looking
+ * up a key press or button press is a single probe. */
+template <size_t N> class Bindtable {
+      public:
+	consteval explicit Bindtable(std::array<uint64_t, N> const& binds) : binds{binds}
+	{
+		unique = std::ranges::all_of(binds, [&](auto bind) {
+			return std::ranges::count(binds, bind) == 1;
+		});
+		/* Consecutive odd multipliers hash small keys to nearly the same slots, so step by
+		 * the golden ratio instead. */
+		if (unique)
+			while (!place()) mult += 0x9e3779b97f4a7c16;
+	}
+
+	/* Index of the binding, or N when there is none. */
+	[[nodiscard]] constexpr auto find(uint64_t bind) const noexcept -> size_t
+	{
+		auto i = slots[slot(bind)];
+		return (i < N && binds[i] == bind) ? i : N;
+	}
+
+	bool unique{false};
+
+      private:
+	static_assert(N < UINT16_MAX);
+	static constexpr unsigned int BITS{std::bit_width(N) + 3};
+
+	[[nodiscard]] constexpr auto slot(uint64_t bind) const noexcept -> size_t
+	{
+		return (bind * mult) >> (64 - BITS);
+	}
+
+	constexpr auto place() -> bool
+	{
+		for (size_t i = 0; i < N; i++) {
+			auto& s = slots[slot(binds[i])];
+			if (s != UINT16_MAX) {
+				for (size_t j = 0; j < i; j++) slots[slot(binds[j])] = UINT16_MAX;
+				return false;
+			}
+			s = i;
+		}
+		return true;
+	}
+
+	std::array<uint64_t, N> binds;
+	std::array<uint16_t, size_t{1} << BITS> slots{[] {
+		std::array<uint16_t, size_t{1} << BITS> empty{};
+		empty.fill(UINT16_MAX);
+		return empty;
+	}()};
+	uint64_t mult{0x9e3779b97f4a7c15};
+};
+
+static constexpr Bindtable keytable{[] {
+	std::array<uint64_t, std::size(keys)> binds{};
+	for (size_t i = 0; i < binds.size(); i++) binds[i] = bindkey(keys[i].keysym, keys[i].mod);
+	return binds;
+}()};
+static_assert(keytable.unique, "keys[] binds the same key and modifiers twice");
+
+static constexpr Bindtable buttontable{[] {
+	std::array<uint64_t, std::size(buttons)> binds{};
+	for (size_t i = 0; i < binds.size(); i++)
+		binds[i] = bindkey(buttons[i].button, buttons[i].mask);
+	return binds;
+}()};
+static_assert(buttontable.unique, "buttons[] binds the same button and modifiers twice");
+
+/* Every key to grab on the root window, ordered by keysym so grabkeys() looks up the keycodes
+ * of a keysym once however many modifiers it is bound with. */
+static constexpr auto keygrabs{[] {
+	std::array<Key_combination, std::size(keys)> grabs{};
+	for (size_t i = 0; i < grabs.size(); i++)
+		grabs[i] = {static_cast<int>(keys[i].mod), keys[i].keysym};
+	std::ranges::sort(grabs, {}, &Key_combination::keysym);
+	return grabs;
+}()};
+
 void fix()
 {
 	fixwindow(focuswin);
@@ -422,44 +1254,21 @@ void centerpointer(xcb_drawable_t win, Client const* cl)
 		cur_y = cl->height / 2;
 	}
 
+	commit(); /* The window has to be in place before we warp into it. */
 	xcb_warp_pointer(conn, XCB_NONE, win, 0, 0, 0, 0, cur_x, cur_y);
 }
 
 /* Find client with client->id win in global window list or NULL. */
 auto findclient(const xcb_drawable_t* win)
 {
-	auto cl = std::find_if(winlist.cbegin(), winlist.cend(),
-			       [win](Client const& c) { return c.id == *win; });
-
-	return (cl == winlist.cend()) ? nullptr : &*cl;
+	return winlist.get(winindex.find(*win));
 }
 
+/* Have the next commit() check the layers and write the client lists again.
+ * It only does if the managed windows or their order changed. */
 void updateclientlist()
 {
-	uint32_t len, i;
-	xcb_window_t* children;
-	Client const* cl;
-
-	/* can only be called after the first window has been spawn */
-	xcb_query_tree_reply_t* reply =
-		xcb_query_tree_reply(conn, xcb_query_tree(conn, screen->root), nullptr);
-	xcb_delete_property(conn, screen->root, ewmh->_NET_CLIENT_LIST);
-	xcb_delete_property(conn, screen->root, ewmh->_NET_CLIENT_LIST_STACKING);
-
-	if (reply == nullptr) {
-		addtoclientlist(0);
-		return;
-	}
-
-	len = xcb_query_tree_children_length(reply);
-	children = xcb_query_tree_children(reply);
-
-	for (i = 0; i < len; i++) {
-		cl = findclient(&children[i]);
-		if (cl != nullptr) addtoclientlist(cl->id);
-	}
-
-	free(reply);
+	clientlist_stale = restack_due = true;
 }
 
 /* get screen of display */
@@ -476,8 +1285,10 @@ auto xcb_screen_of_display(xcb_connection_t* con, int screen) -> xcb_screen_t*
 void movepointerback(const int16_t startx, const int16_t starty, const Client* client)
 {
 	if (startx > (0 - borderwidth - 1) && startx < (client->width + borderwidth + 1) &&
-	    starty > (0 - borderwidth - 1) && starty < (client->height + borderwidth + 1))
+	    starty > (0 - borderwidth - 1) && starty < (client->height + borderwidth + 1)) {
+		commit(); /* The window has to be in place before we warp into it. */
 		xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0, startx, starty);
+	}
 }
 
 /* Set keyboard focus to follow mouse pointer. Then exit. We don't need to
@@ -488,8 +1299,11 @@ void cleanup()
 	free(ev);
 	monlist.clear();
 	for (auto& i : wslists) { i.clear(); }
+	winindex.clear();
 	winlist.clear();
+	preview.reset();
 	ewmh = nullptr;
+	keysyms = nullptr;
 	if (!conn) { return; }
 	xcb_set_input_focus(conn, XCB_NONE, XCB_INPUT_FOCUS_POINTER_ROOT, XCB_CURRENT_TIME);
 	xcb_flush(conn);
@@ -502,13 +1316,11 @@ void arrangewindows()
 	for (auto& item : winlist) { fitonscreen(&item); }
 }
 
-auto getwmdesktop(xcb_drawable_t win) -> uint32_t
+auto getwmdesktop(xcb_get_property_cookie_t cookie) -> uint32_t
 { // Get EWWM hint so we might know what workspace window win should be visible on.
   // Returns either workspace, NET_WM_FIXED if this window should be
   // visible on all workspaces or TWOBWM_NOWS if we didn't find any hints.
-	xcb_get_property_cookie_t cookie =
-		xcb_get_property(conn, false, win, ewmh->_NET_WM_DESKTOP, XCB_GET_PROPERTY_TYPE_ANY,
-				 0, sizeof(uint32_t));
+  // The cookie asks for _NET_WM_DESKTOP, see setupscreen().
 	xcb_get_property_reply_t* reply = xcb_get_property_reply(conn, cookie, nullptr);
 	if (nullptr == reply ||
 	    0 == xcb_get_property_value_length(reply)) { /* 0 if we didn't find it. */
@@ -520,16 +1332,13 @@ auto getwmdesktop(xcb_drawable_t win) -> uint32_t
 	return wsp;
 }
 
-/* check if the window is unkillable, if yes return true */
-auto get_unkil_state(xcb_drawable_t win) -> bool
+/* check if the window is unkillable, if yes return true. The cookie asks
+ * for _NET_WM_STATE_DEMANDS_ATTENTION, see setupscreen(). */
+auto get_unkil_state(xcb_get_property_cookie_t cookie) -> bool
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t* reply;
 	uint8_t wsp;
 
-	cookie = xcb_get_property(conn, false, win, ewmh->_NET_WM_STATE_DEMANDS_ATTENTION,
-				  XCB_GET_PROPERTY_TYPE_ANY, 0, sizeof(uint8_t));
-
 	reply = xcb_get_property_reply(conn, cookie, nullptr);
 
 	if (reply == nullptr || xcb_get_property_value_length(reply) == 0) {
@@ -547,7 +1356,7 @@ auto get_unkil_state(xcb_drawable_t win) -> bool
 		return false;
 }
 
-void check_name(Client* client)
+void check_name(Client* client, xcb_get_property_cookie_t cookie)
 {
 	xcb_get_property_reply_t* reply;
 	unsigned int reply_len;
@@ -556,10 +1365,7 @@ void check_name(Client* client)
 
 	if (nullptr == client) return;
 
-	reply = xcb_get_property_reply(conn,
-				       xcb_get_property(conn, false, client->id, getatom(LOOK_INTO),
-							XCB_GET_PROPERTY_TYPE_ANY, 0, 60),
-				       nullptr);
+	reply = xcb_get_property_reply(conn, cookie, nullptr);
 
 	if (reply == nullptr || xcb_get_property_value_length(reply) == 0) {
 		if (nullptr != reply) free(reply);
@@ -588,6 +1394,9 @@ void check_name(Client* client)
 /* Add a window, specified by client, to workspace ws. */
 void addtoworkspace(Client* client, size_t ws)
 {
+	/* Fixed windows go on their own list, so switching workspaces
+	 * never has to touch them. */
+	if (client->fixed) ws = FIXED_WS;
 	wslists[ws].push_back(client);
 
 	// Remember our new workspace.
@@ -598,33 +1407,22 @@ void addtoworkspace(Client* client, size_t ws)
 				    XCB_ATOM_CARDINAL, 32, 1, &ws);
 }
 
-void addtoclientlist(const xcb_drawable_t id)
-{
-	xcb_change_property(conn, XCB_PROP_MODE_APPEND, screen->root, ewmh->_NET_CLIENT_LIST,
-			    XCB_ATOM_WINDOW, 32, 1, &id);
-	xcb_change_property(conn, XCB_PROP_MODE_APPEND, screen->root,
-			    ewmh->_NET_CLIENT_LIST_STACKING, XCB_ATOM_WINDOW, 32, 1, &id);
-}
-
 /* Change current workspace to ws */
 void changeworkspace_helper(size_t const ws)
 {
 	if (ws == curws) return;
 	xcb_ewmh_set_current_desktop(ewmh.get(), 0, ws);
-	/* Go through list of current ws.
-	 * Unmap everything that isn't fixed. */
+	/* Go through list of current ws and unmap everything.
+	 * Fixed windows are not on it. */
 	for (auto client : wslists[curws]) {
 		setborders(client, false);
-		if (!client->fixed) {
-			xcb_unmap_window(conn, client->id);
-		} else {
-			// correct order is delete first add later.
-			delfromworkspace(client);
-			addtoworkspace(client, ws);
-		}
+		xcb_unmap_window(conn, client->id);
 	}
 	for (auto client : wslists[ws]) {
-		if (!client->fixed && !client->iconic) xcb_map_window(conn, client->id);
+		if (client->iconic) continue;
+		xcb_map_window(conn, client->id);
+		/* Catch up on what changed while it was hidden. */
+		setborders(client, client->focusborder);
 	}
 	curws = ws;
 	auto pointer =
@@ -639,19 +1437,14 @@ void changeworkspace_helper(size_t const ws)
 
 void always_on_top()
 {
-	Client const* cl = nullptr;
-
 	if (focuswin == nullptr) return;
 
-	if (top_win != focuswin->id) {
-		if (0 != top_win) cl = findclient(&top_win);
-
-		top_win = focuswin->id;
-		if (nullptr != cl) setborders(cl, false);
-
-		raisewindow(top_win);
+	if (focuswin->layer != LAYER_ABOVE) {
+		focuswin->layer = LAYER_ABOVE;
+		raisewindow(focuswin->id);
 	} else
-		top_win = 0;
+		focuswin->layer = LAYER_NORMAL;
+	restack_due = true;
 
 	setborders(focuswin, true);
 }
@@ -663,15 +1456,17 @@ void fixwindow(Client* client)
 
 	if (nullptr == client) return;
 
+	delfromworkspace(client);
+
 	if (client->fixed) {
 		client->fixed = false;
-		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id, ewmh->_NET_WM_DESKTOP,
-				    XCB_ATOM_CARDINAL, 32, 1, &curws);
+		addtoworkspace(client, curws);
 	} else {
 		/* Raise the window, if going to another desktop don't
 		 * let the fixed window behind. */
 		raisewindow(client->id);
 		client->fixed = true;
+		addtoworkspace(client, curws);
 		ww = NET_WM_FIXED;
 		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id, ewmh->_NET_WM_DESKTOP,
 				    XCB_ATOM_CARDINAL, 32, 1, &ww);
@@ -706,7 +1501,6 @@ void sendtoworkspace(const Arg* arg)
 	delfromworkspace(focuswin);
 	addtoworkspace(focuswin, arg->i);
 	xcb_unmap_window(conn, focuswin->id);
-	xcb_flush(conn);
 }
 
 void sendtonextworkspace(const Arg* arg)
@@ -727,12 +1521,20 @@ void sendtoprevworkspace(const Arg* arg)
 void forgetclient(Client* client)
 {
 	if (nullptr == client) return;
-	if (client->id == top_win) top_win = 0;
+	/* Let go of the pointer if we were dragging it around. */
+	if (drag && drag->client == client->handle) stopdrag(nullptr);
 	/* Delete client from the workspace list it belongs to. */
 	delfromworkspace(client);
 
+	if (client == focuswin) focuswin = nullptr;
+	std::erase_if(restacklist, [client](auto const& r) { return r.first == client->id; });
+	for (auto const& tile : client->bordertiles)
+		if (XCB_NONE != tile.pmap) xcb_free_pixmap(conn, tile.pmap);
+	if (XCB_NONE != client->syncalarm) xcb_sync_destroy_alarm(conn, client->syncalarm);
+
 	// Remove from global window list.
-	winlist.remove(*client);
+	winindex.erase(client->id);
+	winlist.erase(client->handle);
 }
 
 /* Forget everything about a client with client->id win. */
@@ -740,9 +1542,7 @@ void forgetwin(xcb_window_t win)
 {
 	// Find this window in the global window list. Forget it and free allocated data, it might
 	// already be freed by handling an UnmapNotify.
-	forgetclient(&*std::find_if(winlist.begin(), winlist.end(),
-				    [win](Client tofind) { return win == tofind.id; }));
-	return;
+	forgetclient(findclient(&win));
 }
 
 void getmonsize(int8_t with_offsets, int16_t* mon_x, int16_t* mon_y, uint16_t* mon_width,
@@ -769,6 +1569,28 @@ void getmonsize(int8_t with_offsets, int16_t* mon_x, int16_t* mon_y, uint16_t* m
 	}
 }
 
+/* What bounds the geometry of client on its monitor, for constrain(). */
+auto getconstraints(Client const* client) -> Constraints
+{
+	Constraints c{};
+
+	getmonsize(1, &c.area.x, &c.area.y, &c.area.width, &c.area.height, client);
+	getmonsize(0, &c.full.x, &c.full.y, &c.full.width, &c.full.height, client);
+	c.min_width = client->min_width;
+	c.min_height = client->min_height;
+	c.max_width = client->max_width;
+	c.max_height = client->max_height;
+	if (resize_by_line) {
+		c.width_inc = client->width_inc;
+		c.height_inc = client->height_inc;
+		c.base_width = client->base_width;
+		c.base_height = client->base_height;
+	}
+	c.bw = client->ignore_borders ? 0 : borderwidth;
+	c.magnet = magnet_border;
+	return c;
+}
+
 void maximize_helper(Client* client, uint16_t mon_x, uint16_t mon_y, uint16_t mon_width,
 		     uint16_t mon_height)
 {
@@ -777,13 +1599,14 @@ void maximize_helper(Client* client, uint16_t mon_x, uint16_t mon_y, uint16_t mo
 	values[0] = 0;
 	saveorigsize(client);
 	xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
+	client->painted = {}; /* Paint it again once it has a border. */
 
 	client->x = mon_x;
 	client->y = mon_y;
 	client->width = mon_width;
 	client->height = mon_height;
 
-	moveresize(client->id, client->x, client->y, client->width, client->height);
+	moveresize(client);
 	client->maxed = true;
 }
 
@@ -799,7 +1622,8 @@ void fitonscreen(Client* client)
 	getmonsize(1, &mon_x, &mon_y, &mon_width, &mon_height, client);
 
 	if (client->maxed) {
-		client->maxed = false;
+		client->maxed = client->isfullscreen = false;
+		restack_due = true;
 		setborders(client, false);
 	} else {
 		/* not maxed but look as if it was maxed, then make it maxed */
@@ -867,9 +1691,9 @@ void fitonscreen(Client* client)
 		willmove = true;
 	}
 
-	if (willmove) movewindow(client->id, client->x, client->y);
+	if (willmove) movewindow(client);
 
-	if (willresize) resize(client->id, client->width, client->height);
+	if (willresize) resize(client);
 }
 
 /* Set position, geometry and attributes of a new window and show it on
@@ -883,25 +1707,44 @@ void newwin(xcb_generic_event_t* ev)
 	 * but since it's unmapped it probably belongs on another workspace.*/
 	if (nullptr != findclient(&e->window)) return;
 
-	auto client = setupwin(e->window);
+	auto before = roundtrips;
+	/* Ask for the pointer along with the window's properties, we
+	 * might need it to place the window. */
+	auto cookies = requestwin(e->window);
+	auto pointer_cookie = xcb_query_pointer(conn, screen->root);
+	/* Everything was requested at once, so only the first reply blocks. */
+	roundtrips++;
+	auto client = setupwin(e->window, cookies);
 
-	if (nullptr == client) return;
+	if (nullptr == client) {
+		xcb_discard_reply(conn, pointer_cookie.sequence);
+		return;
+	}
 
 	/* Add this window to the current workspace. */
 	addtoworkspace(client, curws);
+	snapchanged(client);
 
 	/* If we don't have specific coord map it where the pointer is.*/
 	if (!client->usercoord) {
-		if (!getpointer(&screen->root, &client->x, &client->y)) client->x = client->y = 0;
+		auto pointer = xcb_query_pointer_reply(conn, pointer_cookie, nullptr);
+		client->x = client->y = 0;
+		if (nullptr != pointer) {
+			client->x = pointer->win_x;
+			client->y = pointer->win_y;
+			free(pointer);
+		}
 
 		client->x -= client->width / 2;
 		client->y -= client->height / 2;
-		movewindow(client->id, client->x, client->y);
+		movewindow(client);
+	} else {
+		xcb_discard_reply(conn, pointer_cookie.sequence);
 	}
 
 	/* Find the physical output this window will be on if RANDR is active */
 	if (-1 != randrbase) {
-		client->monitor = findmonbycoord(client->x, client->y);
+		client->monitor = findmonbyrect(client);
 		if (nullptr == client->monitor && !monlist.empty())
 			/* Window coordinates are outside all physical monitors.
 			 * Choose the first screen.*/
@@ -910,7 +1753,8 @@ void newwin(xcb_generic_event_t* ev)
 
 	fitonscreen(client);
 
-	/* Show window on screen. */
+	/* Show window on screen, where we placed it. */
+	commit();
 	xcb_map_window(conn, client->id);
 	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id, ewmh->_NET_WM_STATE,
 			    ewmh->_NET_WM_STATE, 32, 2, data);
@@ -921,34 +1765,56 @@ void newwin(xcb_generic_event_t* ev)
 	if (!client->maxed) setborders(client, true);
 	// always focus new window
 	setfocus(client);
+
+	if constexpr (print_stats)
+		fprintf(stderr, "2bwm: MapRequest for 0x%x took %u round trips\n", e->window,
+			roundtrips - before);
 }
 
-/* Set border colour, width and event mask for window. */
-auto setupwin(xcb_window_t win) -> Client*
+/* Send all the requests setupwin() needs answered, without waiting. */
+auto requestwin(xcb_window_t win) -> Wincookies
+{
+	return {.type = xcb_ewmh_get_wm_window_type(ewmh.get(), win),
+		.hints = xcb_icccm_get_wm_normal_hints_unchecked(conn, win),
+		.transient = xcb_icccm_get_wm_transient_for_unchecked(conn, win),
+		.name = xcb_get_property(conn, false, win, ATOM[look_into],
+					 XCB_GET_PROPERTY_TYPE_ANY, 0, 60),
+		.protocols = xcb_icccm_get_wm_protocols_unchecked(conn, win, ewmh->WM_PROTOCOLS),
+		.counter = xcb_get_property(conn, false, win, ewmh->_NET_WM_SYNC_REQUEST_COUNTER,
+					    XCB_ATOM_CARDINAL, 0, 1),
+		.geom = xcb_get_geometry(conn, win)};
+}
+
+/* Set border colour, width and event mask for window. The cookies come from
+ * requestwin() and are all consumed. */
+auto setupwin(xcb_window_t win, Wincookies const& cookies) -> Client*
 {
 	unsigned int i;
-	uint8_t result;
 	uint32_t values[2];
 	xcb_atom_t a;
-	xcb_size_hints_t hints;
+	xcb_size_hints_t hints{};
 	xcb_ewmh_get_atoms_reply_t win_type;
 	xcb_window_t prop;
-	xcb_get_property_cookie_t cookie;
+	bool managed = true;
 
-	if (xcb_ewmh_get_wm_window_type_reply(ewmh.get(),
-					      xcb_ewmh_get_wm_window_type(ewmh.get(), win),
-					      &win_type, nullptr) == 1) {
+	if (xcb_ewmh_get_wm_window_type_reply(ewmh.get(), cookies.type, &win_type, nullptr) == 1) {
 		for (i = 0; i < win_type.atoms_len; i++) {
 			a = win_type.atoms[i];
 			if (a == ewmh->_NET_WM_WINDOW_TYPE_TOOLBAR ||
 			    a == ewmh->_NET_WM_WINDOW_TYPE_DOCK ||
-			    a == ewmh->_NET_WM_WINDOW_TYPE_DESKTOP) {
-				xcb_map_window(conn, win);
-				return nullptr;
-			}
+			    a == ewmh->_NET_WM_WINDOW_TYPE_DESKTOP)
+				managed = false;
 		}
 		xcb_ewmh_get_atoms_reply_wipe(&win_type);
 	}
+	if (!managed) {
+		for (auto cookie : {cookies.hints, cookies.transient, cookies.name,
+				    cookies.protocols, cookies.counter})
+			xcb_discard_reply(conn, cookie.sequence);
+		xcb_discard_reply(conn, cookies.geom.sequence);
+		xcb_map_window(conn, win);
+		return nullptr;
+	}
 	values[0] = XCB_EVENT_MASK_ENTER_WINDOW;
 	xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXEL, &emptycol);
 	xcb_change_window_attributes_checked(conn, win, XCB_CW_EVENT_MASK, values);
@@ -957,16 +1823,22 @@ auto setupwin(xcb_window_t win) -> Client*
 	xcb_change_save_set(conn, XCB_SET_MODE_INSERT, win);
 
 	/* Remember window and store a few things about it. */
-	auto client = &winlist.emplace_front(
-		Client{win, screen->width_in_pixels, screen->height_in_pixels});
+	auto client = winlist.emplace(win, screen->width_in_pixels, screen->height_in_pixels);
+	winindex.insert(win, client->handle);
 
 	/* Get window geometry. */
-	getgeom(&client->id, &client->x, &client->y, &client->width, &client->height,
-		&client->depth);
+	if (auto geom = xcb_get_geometry_reply(conn, cookies.geom, nullptr); nullptr != geom) {
+		client->x = geom->x;
+		client->y = geom->y;
+		client->width = geom->width;
+		client->height = geom->height;
+		client->depth = geom->depth;
+		client->sent = {geom->x, geom->y, geom->width, geom->height};
+		free(geom);
+	}
 
 	/* Get the window's incremental size step, if any.*/
-	xcb_icccm_get_wm_normal_hints_reply(
-		conn, xcb_icccm_get_wm_normal_hints_unchecked(conn, win), &hints, nullptr);
+	xcb_icccm_get_wm_normal_hints_reply(conn, cookies.hints, &hints, nullptr);
 
 	/* The user specified the position coordinates.
 	 * Remember that so we can use geometry later. */
@@ -991,10 +1863,8 @@ auto setupwin(xcb_window_t win) -> Client*
 		client->base_width = hints.base_width;
 		client->base_height = hints.base_height;
 	}
-	cookie = xcb_icccm_get_wm_transient_for_unchecked(conn, win);
-	if (cookie.sequence > 0) {
-		result = xcb_icccm_get_wm_transient_for_reply(conn, cookie, &prop, nullptr);
-		if (result) {
+	if (cookies.transient.sequence > 0) {
+		if (xcb_icccm_get_wm_transient_for_reply(conn, cookies.transient, &prop, nullptr)) {
 			Client const* parent = findclient(&prop);
 			if (parent) {
 				client->usercoord = true;
@@ -1006,44 +1876,74 @@ auto setupwin(xcb_window_t win) -> Client*
 		}
 	}
 
-	check_name(client);
+	/* Clients that tell when they have drawn a new size get resized in step with that. */
+	xcb_icccm_get_wm_protocols_reply_t protocols;
+	bool sync = false;
+	if (xcb_icccm_get_wm_protocols_reply(conn, cookies.protocols, &protocols, nullptr) == 1) {
+		for (i = 0; i < protocols.atoms_len; i++)
+			if (protocols.atoms[i] == ewmh->_NET_WM_SYNC_REQUEST) sync = true;
+		xcb_icccm_get_wm_protocols_reply_wipe(&protocols);
+	}
+	if (auto counter = xcb_get_property_reply(conn, cookies.counter, nullptr);
+	    nullptr != counter) {
+		if (sync && xcb_get_property_value_length(counter) >= 4)
+			watchsync(client, *(xcb_sync_counter_t*)xcb_get_property_value(counter));
+		free(counter);
+	}
+
+	check_name(client, cookies.name);
 	return client;
 }
 
 /* wrapper to get xcb keycodes from keysymbol */
 auto xcb_get_keycodes(xcb_keysym_t keysym) -> xcb_keycode_t*
 {
-	xcb_key_symbols_t* keysyms;
-	xcb_keycode_t* keycode;
-
-	if (!(keysyms = xcb_key_symbols_alloc(conn))) return nullptr;
-
-	keycode = xcb_key_symbols_get_keycode(keysyms, keysym);
-	xcb_key_symbols_free(keysyms);
-
-	return keycode;
+	return xcb_key_symbols_get_keycode(keysyms.get(), keysym);
 }
 
-// the wm should listen to key presses
+/* The wm should listen to key presses. Works out every keycode and modifier combination
+ * keys[] needs under the current keyboard map and only ungrabs and grabs the ones that
+ * differ from what we already hold, so a new map never leaves the keys ungrabbed. */
 void grabkeys()
 {
-	xcb_keycode_t* keycode;
+	xcb_keycode_t* keycode = nullptr;
+	xcb_keysym_t keysym = XCB_NO_SYMBOL;
 	unsigned int modifiers[] = {0, XCB_MOD_MASK_LOCK, numlockmask,
 				    numlockmask | XCB_MOD_MASK_LOCK};
+	std::vector<uint32_t> wanted, stale, fresh;
 
-	xcb_ungrab_key(conn, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
-
-	for (const auto& key : keys) {
-		keycode = xcb_get_keycodes(key.keysym);
+	for (const auto& grab : keygrabs) {
+		if (grab.keysym != keysym) {
+			free(keycode); // allocated in xcb_get_keycodes()
+			keysym = grab.keysym;
+			keycode = xcb_get_keycodes(keysym);
+		}
+		if (nullptr == keycode) continue;
 
 		for (auto k = 0; keycode[k] != XCB_NO_SYMBOL; k++)
 			for (auto modifier : modifiers)
-				xcb_grab_key(conn, 1, screen->root, key.mod | modifier, keycode[k],
-					     XCB_GRAB_MODE_ASYNC, // pointer mode
-					     XCB_GRAB_MODE_ASYNC  // keyboard mode
-				);
-		free(keycode); // allocated in xcb_get_keycodes()
+				wanted.push_back(keycode[k] << 16 |
+						 ((grab.mod | modifier) & 0xffff));
 	}
+	free(keycode);
+
+	std::ranges::sort(wanted);
+	wanted.erase(std::ranges::unique(wanted).begin(), wanted.end());
+	std::ranges::set_difference(keygrabbed, wanted, std::back_inserter(stale));
+	std::ranges::set_difference(wanted, keygrabbed, std::back_inserter(fresh));
+
+	for (auto g : stale) xcb_ungrab_key(conn, g >> 16, screen->root, g & 0xffff);
+	for (auto g : fresh)
+		xcb_grab_key(conn, 1, screen->root, g & 0xffff, g >> 16,
+			     XCB_GRAB_MODE_ASYNC, // pointer mode
+			     XCB_GRAB_MODE_ASYNC  // keyboard mode
+		);
+
+	if constexpr (print_stats)
+		fprintf(stderr, "2bwm: %u keyboard changes, %zu keys ungrabbed, %zu grabbed\n",
+			mappingnotifies, stale.size(), fresh.size());
+	keygrabbed = std::move(wanted);
+	mappingnotifies = 0;
 }
 
 auto setup_keyboard() -> bool
@@ -1062,6 +1962,7 @@ auto setup_keyboard() -> bool
 	if (!modmap) return false;
 
 	numlock = xcb_get_keycodes(XK_Num_Lock);
+	numlockmask = 0;
 
 	for (i = 4; i < 8; i++) {
 		for (j = 0; j < reply->keycodes_per_modifier; j++) {
@@ -1084,17 +1985,29 @@ auto setup_keyboard() -> bool
 	return true;
 }
 
-/* Walk through all existing windows and set them up. returns true on success */
+/* Walk through all existing windows and set them up. returns true on success.
+ * Requests go out in bulk: first the attributes of every child, then
+ * everything we need about the ones we manage, and only then are the
+ * replies processed, so adopting any number of windows costs a few round
+ * trips. */
 auto setupscreen() -> bool
 {
-	xcb_get_window_attributes_reply_t* attr;
+	/* A window to manage and the requests sent for it. */
+	struct Adoptee {
+		xcb_window_t win;
+		Wincookies cookies;
+		xcb_get_property_cookie_t desktop, unkil;
+	};
+	std::vector<Adoptee> adoptees;
 	Client* client;
 	uint32_t ws;
 	uint32_t len;
 	xcb_window_t* children;
 	uint32_t i;
+	auto start = std::chrono::steady_clock::now();
 
 	/* Get all children. */
+	roundtrips++;
 	xcb_query_tree_reply_t* reply =
 		xcb_query_tree_reply(conn, xcb_query_tree(conn, screen->root), nullptr);
 
@@ -1102,11 +2015,15 @@ auto setupscreen() -> bool
 
 	len = xcb_query_tree_children_length(reply);
 	children = xcb_query_tree_children(reply);
+	/* Keep the stacking order from here on, the children come bottom first. */
+	stacking.assign(children, children + len);
 
-	/* Set up all windows on this root. */
+	std::vector<xcb_get_window_attributes_cookie_t> attr_cookies(len);
+	for (i = 0; i < len; i++) attr_cookies[i] = xcb_get_window_attributes(conn, children[i]);
+
+	roundtrips++;
 	for (i = 0; i < len; i++) {
-		attr = xcb_get_window_attributes_reply(
-			conn, xcb_get_window_attributes(conn, children[i]), nullptr);
+		auto attr = xcb_get_window_attributes_reply(conn, attr_cookies[i], nullptr);
 
 		if (!attr) continue;
 
@@ -1114,53 +2031,91 @@ auto setupscreen() -> bool
 		 * This mode means they wouldn't have been reported to us with a
 		 * MapRequest if we had been running, so in the normal case we wouldn't
 		 * have seen them. Only handle visible windows. */
-		if (!attr->override_redirect && attr->map_state == XCB_MAP_STATE_VIEWABLE) {
-			client = setupwin(children[i]);
-
-			if (nullptr != client) {
-				/* Find the physical output this window will be on if
-				 * RANDR is active. */
-				if (-1 != randrbase)
-					client->monitor = findmonbycoord(client->x, client->y);
-				/* Fit window on physical screen. */
-				fitonscreen(client);
-				setborders(client, false);
-
-				/* Check if this window has a workspace set already
-				 * as a WM hint. */
-				ws = getwmdesktop(children[i]);
-
-				if (get_unkil_state(children[i])) unkillablewindow(client);
-
-				if (ws == NET_WM_FIXED) {
-					/* Add to current workspace. */
-					addtoworkspace(client, curws);
-					/* Add to all other workspaces. */
-					fixwindow(client);
-				} else {
-					if (TWOBWM_NOWS != ws && ws < WORKSPACES) {
-						addtoworkspace(client, ws);
-						if (ws != curws)
-							/* If it's not our current works
-							 * pace, hide it. */
-							xcb_unmap_window(conn, client->id);
-					} else {
-						addtoworkspace(client, curws);
-						addtoclientlist(children[i]);
-					}
-				}
-			}
+		if (!attr->override_redirect && attr->map_state == XCB_MAP_STATE_VIEWABLE)
+			adoptees.push_back(
+				{children[i], requestwin(children[i]),
+				 xcb_get_property(conn, false, children[i], ewmh->_NET_WM_DESKTOP,
+						  XCB_GET_PROPERTY_TYPE_ANY, 0, sizeof(uint32_t)),
+				 xcb_get_property(conn, false, children[i],
+						  ewmh->_NET_WM_STATE_DEMANDS_ATTENTION,
+						  XCB_GET_PROPERTY_TYPE_ANY, 0, sizeof(uint8_t))});
+
+		free(attr);
+	}
+
+	/* Set up all windows on this root. */
+	roundtrips++;
+	for (auto const& adoptee : adoptees) {
+		client = setupwin(adoptee.win, adoptee.cookies);
+
+		if (nullptr == client) {
+			xcb_discard_reply(conn, adoptee.desktop.sequence);
+			xcb_discard_reply(conn, adoptee.unkil.sequence);
+			continue;
 		}
 
-		if (nullptr != attr) free(attr);
+		/* Find the physical output this window will be on if
+		 * RANDR is active. */
+		if (-1 != randrbase) client->monitor = findmonbyrect(client);
+		/* Fit window on physical screen. */
+		fitonscreen(client);
+		setborders(client, false);
+
+		/* Check if this window has a workspace set already
+		 * as a WM hint. */
+		ws = getwmdesktop(adoptee.desktop);
+
+		if (get_unkil_state(adoptee.unkil)) unkillablewindow(client);
+
+		if (ws == NET_WM_FIXED) {
+			/* Add to current workspace. */
+			addtoworkspace(client, curws);
+			/* Add to all other workspaces. */
+			fixwindow(client);
+		} else {
+			if (TWOBWM_NOWS != ws && ws < WORKSPACES) {
+				addtoworkspace(client, ws);
+				if (ws != curws)
+					/* If it's not our current works
+					 * pace, hide it. */
+					xcb_unmap_window(conn, client->id);
+			} else {
+				addtoworkspace(client, curws);
+			}
+		}
 	}
 	changeworkspace_helper(0);
 
-	if (nullptr != reply) free(reply);
+	free(reply);
+
+	if constexpr (print_stats) {
+		/* Wait until the server has handled everything we sent. */
+		free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), nullptr));
+		std::chrono::duration<double, std::milli> took =
+			std::chrono::steady_clock::now() - start;
+		fprintf(stderr, "2bwm: managed %zu of %u windows in %.1f ms\n", adoptees.size(),
+			len, took.count());
+	}
 
 	return true;
 }
 
+/* Set up the XSync extension, which clients use to tell when they have
+ * drawn a new size. Returns the beginning of its events or -1. */
+auto setupsync() -> int
+{
+	const xcb_query_extension_reply_t* extension = xcb_get_extension_data(conn, &xcb_sync_id);
+
+	if (nullptr == extension || !extension->present) return -1;
+
+	roundtrips++;
+	free(xcb_sync_initialize_reply(
+		conn, xcb_sync_initialize(conn, XCB_SYNC_MAJOR_VERSION, XCB_SYNC_MINOR_VERSION),
+		nullptr));
+
+	return extension->first_event;
+}
+
 /* Set up RANDR extension. Get the extension base and subscribe to events */
 auto setuprandr() -> int
 {
@@ -1197,12 +2152,14 @@ void getrandr()
 	xcb_randr_output_t* outputs = xcb_randr_get_screen_resources_current_outputs(res);
 
 	/* Request information for all outputs. */
-	getoutputs(outputs, len, timestamp);
+	getoutputs(outputs, len, timestamp, res);
 	free(res);
 }
 
-/* Walk through all the RANDR outputs (number of outputs == len) there */
-void getoutputs(xcb_randr_output_t* outputs, const int len, xcb_timestamp_t timestamp)
+/* Walk through all the RANDR outputs (number of outputs == len) there. monindex
+ * is rebuilt as soon as monlist changes, before windows are fitted to it. */
+void getoutputs(xcb_randr_output_t* outputs, const int len, xcb_timestamp_t timestamp,
+		xcb_randr_get_screen_resources_current_reply_t* res)
 {
 	/* was at time timestamp. */
 	xcb_randr_get_crtc_info_cookie_t icookie;
@@ -1234,10 +2191,11 @@ void getoutputs(xcb_randr_output_t* outputs, const int len, xcb_timestamp_t time
 			if (nullptr != clonemon) continue;
 
 			/* Do we know this monitor already? */
-			if (auto mon = findmonitor(outputs[i]); mon == nullptr)
+			if (auto mon = findmonitor(outputs[i]); mon == nullptr) {
 				monlist.emplace_front(outputs[i], crtc->x, crtc->y, crtc->width,
 						      crtc->height);
-			else
+				monindex.rebuild(monlist);
+			} else
 				/* We know this monitor. Update information.
 				 * If it's smaller than before, rearrange windows. */
 				if (crtc->x != mon->x || crtc->y != mon->y ||
@@ -1246,12 +2204,15 @@ void getoutputs(xcb_randr_output_t* outputs, const int len, xcb_timestamp_t time
 				if (crtc->y != mon->y) mon->y = crtc->y;
 				if (crtc->width != mon->width) mon->width = crtc->width;
 				if (crtc->height != mon->height) mon->height = crtc->height;
+				monindex.rebuild(monlist);
 
 				// TODO when lid closed, one screen
 				for (auto& item : winlist) {
 					if (item.monitor == mon) fitonscreen(&item);
 				}
 			}
+			/* Drags on it are paced to the mode it shows. */
+			findmonitor(outputs[i])->refresh = refreshrate(res, crtc->mode);
 			free(crtc);
 		} else {
 			/* Check if it was used before. If it was, do something. */
@@ -1260,23 +2221,51 @@ void getoutputs(xcb_randr_output_t* outputs, const int len, xcb_timestamp_t time
 				    std::find_if(monlist.begin(), monlist.end(),
 						 [id](Monitor const& mon) { return mon.id == id; });
 			    mon != monlist.end()) {
+				std::vector<Client*> moved;
 				for (auto& client : winlist) {
 					// Check all windows on this monitor and move them to the
 					// next or to the first monitor if there is no next.
 					if (client.monitor == &*mon) {
-						if (mon == std::prev(monlist.end())) {
+						if (monlist.size() == 1) {
+							client.monitor = nullptr;
+						} else if (mon == std::prev(monlist.end())) {
 							client.monitor = &monlist.front();
 						} else {
 							client.monitor = &*std::next(mon);
 						};
-						fitonscreen(&client);
+						moved.push_back(&client);
 					}
 				}
+				// Forget it so nothing gets placed on it anymore, then fit
+				// its windows to what is left.
+				monlist.erase(mon);
+				monindex.rebuild(monlist);
+				for (auto* client : moved) fitonscreen(client);
 			}
 		}
 	}
 }
 
+/* Refresh rate of mode in mHz, 0 if res doesn't list it. */
+auto refreshrate(xcb_randr_get_screen_resources_current_reply_t* res, xcb_randr_mode_t mode)
+	-> uint32_t
+{
+	auto const* modes = xcb_randr_get_screen_resources_current_modes(res);
+	auto const len = xcb_randr_get_screen_resources_current_modes_length(res);
+
+	for (auto i = 0; i < len; i++) {
+		if (modes[i].id != mode) continue;
+
+		uint64_t lines = modes[i].vtotal;
+		if (modes[i].mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN) lines *= 2;
+		if (modes[i].mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE) lines /= 2;
+		if (0 == lines || 0 == modes[i].htotal) return 0;
+
+		return uint64_t{modes[i].dot_clock} * 1000 / (modes[i].htotal * lines);
+	}
+	return 0;
+}
+
 // XXX die folgenden drei Funktionen können zusammengefaßt werden
 auto findmonitor(xcb_randr_output_t id) -> Monitor*
 {
@@ -1299,38 +2288,399 @@ auto findclones(xcb_randr_output_t id, const int16_t x, const int16_t y) -> Moni
 	return nullptr;
 }
 
-auto findmonbycoord(const int16_t x, const int16_t y) -> Monitor*
-{
-	if (auto found =
-		    std::find_if(std::begin(monlist), std::end(monlist),
-				 [x, y](const Monitor& mon) { return mon.x == x && mon.y == y; });
-	    found != std::end(monlist))
-		return &*found;
-	return nullptr;
+/* Find the monitor covering most of the window, borders included. */
+auto findmonbyrect(Client const* client) -> Monitor*
+{
+	auto const bw = static_cast<uint8_t>(client->ignore_borders ? 0 : borderwidth);
+	return monindex.bestfit(client->x, client->y, client->width + bw * 2,
+				client->height + bw * 2);
+}
+
+/* Move the client over to the monitor it is mostly on now. Keeps the old one
+ * if it's entirely off screen. */
+void updatemonitor(Client* client)
+{
+	if (-1 == randrbase) return;
+	if (auto mon = findmonbyrect(client); nullptr != mon) client->monitor = mon;
+}
+
+/* Raise window win to the top of its layer when the state is next committed. */
+void raisewindow(xcb_drawable_t win)
+{
+	if (screen->root == win || 0 == win) return;
+
+	requests_asked++;
+	restacklist.emplace_back(win, true);
+}
+
+/* Lower window win to the bottom of its layer when the state is next committed. */
+void lowerwindow(xcb_drawable_t win)
+{
+	if (screen->root == win || 0 == win) return;
+
+	requests_asked++;
+	restacklist.emplace_back(win, false);
+}
+
+/* The layer client is stacked in. */
+auto stacklayer(Client const* client) -> uint8_t
+{
+	return client->isfullscreen ? uint8_t{LAYER_FULLSCREEN} : client->layer;
+}
+
+/* Mark a longest increasing subsequence of pos. */
+auto inorder(std::vector<size_t> const& pos) -> std::vector<bool>
+{
+	std::vector<size_t> tails, from(pos.size(), SIZE_MAX); // Indices into pos.
+
+	for (size_t i = 0; i < pos.size(); i++) {
+		auto it = std::ranges::lower_bound(tails, pos[i], {},
+						   [&pos](size_t j) { return pos[j]; });
+		if (it != tails.begin()) from[i] = *std::prev(it);
+		if (it == tails.end())
+			tails.push_back(i);
+		else
+			*it = i;
+	}
+
+	std::vector<bool> keep(pos.size(), false);
+	for (size_t i = tails.empty() ? SIZE_MAX : tails.back(); i != SIZE_MAX; i = from[i])
+		keep[i] = true;
+	return keep;
+}
+
+/* Put the managed windows in layer order, after doing the raises and lowers asked
+ * for since the last commit. The longest run of windows that are already in the
+ * right order stays, every other window is moved right above the one that has to
+ * be below it, so a raise is one request and an unchanged order is none. Windows
+ * we don't manage are left where they are. */
+void restack()
+{
+	if (!restack_due && restacklist.empty()) return;
+
+	std::vector<Client*> now; // As the server has them, bottom first.
+	for (auto win : stacking)
+		if (auto client = findclient(&win); nullptr != client) now.push_back(client);
+
+	auto wanted = now;
+	for (auto [win, top] : restacklist) {
+		auto client = findclient(&win);
+		if (nullptr == client || 0 == std::erase(wanted, client)) continue;
+		wanted.insert(top ? wanted.end() : wanted.begin(), client);
+	}
+	restacklist.clear();
+	std::ranges::stable_sort(wanted, {}, stacklayer);
+
+	if (wanted != now) {
+		std::vector<std::pair<Client*, size_t>> at;
+		for (size_t i = 0; i < now.size(); i++) at.emplace_back(now[i], i);
+		std::ranges::sort(at);
+
+		std::vector<size_t> pos;
+		for (auto client : wanted) {
+			std::pair<Client*, size_t> const key{client, 0};
+			pos.push_back(std::ranges::lower_bound(at, key)->second);
+		}
+		auto const keep = inorder(pos);
+		auto const first = std::ranges::find(keep, true) - keep.begin();
+		uint16_t const mask = XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE;
+
+		for (size_t i = 0; i < wanted.size(); i++) {
+			if (keep[i]) continue;
+			auto const win = wanted[i]->id;
+			auto const sibling = 0 == i ? wanted[first]->id : wanted[i - 1]->id;
+			uint32_t const mode = 0 == i ? XCB_STACK_MODE_BELOW : XCB_STACK_MODE_ABOVE;
+			uint32_t const values[] = {sibling, mode};
+
+			xcb_configure_window(conn, win, mask, values);
+			if (0 == i)
+				stackbelow(win, sibling);
+			else
+				stackabove(win, sibling);
+			requests_sent++;
+		}
+	}
+	restack_due = false;
+}
+
+/* Move win in our copy of the stacking order to just above sibling, or to the
+ * bottom if sibling is XCB_NONE. Windows we haven't seen yet are added. Moves
+ * and resizes report the sibling a window already has, so they change nothing. */
+void stackabove(xcb_window_t win, xcb_window_t sibling)
+{
+	if (auto at = std::ranges::find(stacking, win); at != stacking.end()) {
+		if (at == stacking.begin() ? XCB_NONE == sibling : *std::prev(at) == sibling)
+			return;
+		stacking.erase(at);
+	}
+	auto pos = stacking.begin();
+	if (XCB_NONE != sibling) {
+		pos = std::ranges::find(stacking, sibling);
+		if (pos != stacking.end()) pos++;
+	}
+	stacking.insert(pos, win);
+	clientlist_stale = restack_due = true;
+}
+
+/* Move win in our copy of the stacking order to just below sibling. */
+void stackbelow(xcb_window_t win, xcb_window_t sibling)
+{
+	std::erase(stacking, win);
+	stacking.insert(std::ranges::find(stacking, sibling), win);
+	clientlist_stale = restack_due = true;
+}
+
+/* Move win to the top of our copy of the stacking order. */
+void stackontop(xcb_window_t win)
+{
+	std::erase(stacking, win);
+	stacking.push_back(win);
+	clientlist_stale = restack_due = true;
+}
+
+/* Drop win from our copy of the stacking order. */
+void unstack(xcb_window_t win)
+{
+	if (std::erase(stacking, win) > 0) clientlist_stale = true;
+}
+
+/* Write _NET_CLIENT_LIST and _NET_CLIENT_LIST_STACKING, the managed windows
+ * from bottom to top, if that list differs from what we wrote last. */
+void writeclientlist()
+{
+	if (!clientlist_stale) return;
+	clientlist_stale = false;
+
+	std::vector<xcb_window_t> list;
+	list.reserve(stacking.size());
+	for (auto win : stacking)
+		if (nullptr != findclient(&win)) list.push_back(win);
+
+	requests_asked += 2;
+	if (clientlist_sent == list) return;
+
+	for (auto prop : {ewmh->_NET_CLIENT_LIST, ewmh->_NET_CLIENT_LIST_STACKING})
+		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, prop,
+				    XCB_ATOM_WINDOW, 32, list.size(), list.data());
+	requests_sent += 2;
+	clientlist_sent = std::move(list);
+}
+
+/* Note that what of client has to be written to the server. Clients we don't
+ * manage, like the resize preview, are written right away. */
+void markdirty(Client* client, uint8_t what)
+{
+	requests_asked++;
+	if (winlist.get(client->handle) != client) {
+		client->dirty |= what;
+		commitclient(client);
+		return;
+	}
+	if (what & (DIRTY_GEOMETRY | DIRTY_CONFIGURE)) snapchanged(client);
+	if (0 == client->dirty) dirtylist.push_back(client->handle);
+	client->dirty |= what;
+}
+
+/* Have an alarm tell us whenever client's counter reaches the value of its
+ * last _NET_WM_SYNC_REQUEST. */
+void watchsync(Client* client, xcb_sync_counter_t counter)
+{
+	if (-1 == syncbase) return;
+
+	/* It fires right away once, whatever the counter is at, and tells
+	 * syncnotify() where to count on from. Until then sizes wait as if the
+	 * client was drawing. After that it waits for syncrequest() to move it
+	 * on. */
+	uint32_t const values[] = {
+		counter,
+		XCB_SYNC_VALUETYPE_ABSOLUTE,
+		0x80000000, 0, // Value, high word first: the lowest there is.
+		XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON,
+		0, 0, // Delta.
+		true, // Send AlarmNotify.
+	};
+	client->syncalarm = xcb_generate_id(conn);
+	uint32_t const mask = XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE |
+			      XCB_SYNC_CA_TEST_TYPE | XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS;
+	xcb_sync_create_alarm(conn, client->syncalarm, mask, values);
+	client->syncwait = true;
+	client->syncsent = std::chrono::steady_clock::now();
+}
+
+/* Ask client to set its counter once it has drawn the size we are about to
+ * give it, and have its alarm wait for that. */
+void syncrequest(Client* client)
+{
+	auto const value = ++client->syncvalue;
+	auto const lo = static_cast<uint32_t>(value), hi = static_cast<uint32_t>(value >> 32);
+	xcb_client_message_event_t ev = {
+		.response_type = XCB_CLIENT_MESSAGE,
+		.format = 32,
+		.sequence = 0,
+		.window = client->id,
+		.type = ewmh->WM_PROTOCOLS,
+		.data = {.data32 = {ewmh->_NET_WM_SYNC_REQUEST, XCB_CURRENT_TIME, lo, hi}}};
+	xcb_send_event(conn, false, client->id, XCB_EVENT_MASK_NO_EVENT, (char*)&ev);
+
+	uint32_t const values[] = {hi, lo};
+	xcb_sync_change_alarm(conn, client->syncalarm, XCB_SYNC_CA_VALUE, values);
+
+	client->syncwait = true;
+	client->syncsent = std::chrono::steady_clock::now();
+}
+
+/* Whether client is still drawing the last size it got. One that takes
+ * longer than sync_timeout is not waited for. */
+auto syncpending(Client const* client) -> bool
+{
+	return client->syncwait && std::chrono::steady_clock::now() - client->syncsent <
+					   std::chrono::milliseconds{sync_timeout};
+}
+
+/* When the first size commit() holds back stops waiting for its client, if
+ * it holds any back. */
+auto syncdue() -> std::optional<std::chrono::steady_clock::time_point>
+{
+	std::optional<std::chrono::steady_clock::time_point> due;
+
+	for (auto handle : dirtylist) {
+		auto client = winlist.get(handle);
+		if (nullptr == client || !client->syncwait) continue;
+		auto const timeout = client->syncsent + std::chrono::milliseconds{sync_timeout};
+		if (!due || timeout < *due) due = timeout;
+	}
+	return due;
+}
+
+/* A client drew the size we gave it, commit() may send the next. Requests
+ * count on from the value its counter has now. */
+void syncnotify(xcb_generic_event_t* ev)
+{
+	auto* e = (xcb_sync_alarm_notify_event_t*)ev;
+	uint64_t const hi = static_cast<uint32_t>(e->counter_value.hi);
+	auto const value = static_cast<int64_t>(hi << 32 | e->counter_value.lo);
+
+	for (auto& client : winlist)
+		if (client.syncalarm == e->alarm) {
+			client.syncvalue = std::max(client.syncvalue, value);
+			client.syncwait = false;
+		}
+}
+
+/* Write what changed about client: the fields of its geometry that differ
+ * from what we last sent, then its border. A client still drawing the last
+ * size we sent gets its new position, but keeps a new size and the border
+ * for it until it is done. */
+void commitclient(Client* client)
+{
+	if (client->dirty & (DIRTY_GEOMETRY | DIRTY_CONFIGURE)) {
+		bool const all = client->dirty & DIRTY_CONFIGURE;
+		bool const resized = client->width != client->sent.width ||
+				     client->height != client->sent.height;
+		bool held = false;
+		uint32_t values[4];
+		uint16_t mask = 0;
+		uint8_t i = 0;
+
+		if (!all && resized && XCB_NONE != client->syncalarm) {
+			if (syncpending(client)) {
+				resizes_throttled++;
+				if (drag && drag->client == client->handle) drag->throttled++;
+				held = true;
+			} else {
+				syncrequest(client);
+			}
+		}
+
+		if (all || client->x != client->sent.x) {
+			mask |= XCB_CONFIG_WINDOW_X;
+			values[i++] = client->x;
+		}
+		if (all || client->y != client->sent.y) {
+			mask |= XCB_CONFIG_WINDOW_Y;
+			values[i++] = client->y;
+		}
+		if (!held && (all || client->width != client->sent.width)) {
+			mask |= XCB_CONFIG_WINDOW_WIDTH;
+			values[i++] = client->width;
+		}
+		if (!held && (all || client->height != client->sent.height)) {
+			mask |= XCB_CONFIG_WINDOW_HEIGHT;
+			values[i++] = client->height;
+		}
+		if (0 != mask) {
+			xcb_configure_window(conn, client->id, mask, values);
+			requests_sent++;
+		}
+		client->sent.x = client->x;
+		client->sent.y = client->y;
+		/* It stays dirty, the next commit() sends only the size. */
+		if (held) return;
+		client->sent.width = client->width;
+		client->sent.height = client->height;
+	}
+
+	if (client->dirty & DIRTY_BORDER) {
+		if (drawborders(client))
+			requests_sent++;
+		else
+			repaints_skipped++;
+	}
+
+	client->dirty = 0;
 }
 
-/* Raise window win to top of stack. */
-void raisewindow(xcb_drawable_t win)
+/* Write everything event handlers changed since the last commit, so that
+ * each window is configured and repainted at most once. The caller
+ * flushes. */
+void commit()
 {
-	uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+	/* Clients still drawing stay on the list for the next time. */
+	std::erase_if(dirtylist, [](Clienthandle handle) {
+		auto client = winlist.get(handle);
+		if (nullptr != client) commitclient(client);
+		return nullptr == client || 0 == client->dirty;
+	});
 
-	if (screen->root == win || 0 == win) return;
+	restack();
+	writeclientlist();
 
-	xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
-	xcb_flush(conn);
+	if (activewin && activewin != activewin_sent) {
+		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root,
+				    ewmh->_NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW, 32, 1, &*activewin);
+		activewin_sent = activewin;
+		requests_sent++;
+	}
+	activewin.reset();
+
+	if constexpr (print_stats)
+		if (requests_asked > requests_sent)
+			fprintf(stderr,
+				"2bwm: wrote %u of %u requests, %u saved, %u of them border "
+				"repaints, %u resizes waiting for clients to draw\n",
+				requests_sent, requests_asked, requests_asked - requests_sent,
+				repaints_skipped, resizes_throttled);
+	requests_asked = requests_sent = repaints_skipped = resizes_throttled = 0;
 }
 
-/* Set window client to either top or bottom of stack depending on
+/* Set window client to either top or bottom of its layer depending on
  * where it is now. */
 void raiseorlower()
 {
-	uint32_t values[] = {XCB_STACK_MODE_OPPOSITE};
-
 	if (nullptr == focuswin) return;
 
-	xcb_configure_window(conn, focuswin->id, XCB_CONFIG_WINDOW_STACK_MODE, values);
+	auto const layer = stacklayer(focuswin);
+	auto const above = std::ranges::find(stacking, focuswin->id);
+	bool const covered = std::any_of(above + (above != stacking.end()), stacking.end(),
+					 [layer](xcb_window_t win) {
+						 auto cl = findclient(&win);
+						 return nullptr != cl && stacklayer(cl) == layer;
+					 });
 
-	xcb_flush(conn);
+	if (covered)
+		raisewindow(focuswin->id);
+	else
+		lowerwindow(focuswin->id);
 }
 
 /* Keep the window inside the screen */
@@ -1339,6 +2689,7 @@ void movelim(Client* client)
 	int16_t mon_y, mon_x, temp = 0;
 	uint16_t mon_height, mon_width;
 
+	updatemonitor(client);
 	getmonsize(1, &mon_x, &mon_y, &mon_width, &mon_height, client);
 
 	uint8_t const bw{client->ignore_borders ? 0 : borderwidth};
@@ -1354,44 +2705,46 @@ void movelim(Client* client)
 	else if (client->x + client->width + (bw * 2) > mon_x + mon_width - magnet_border)
 		client->x = mon_x + mon_width - client->width - bw * 2;
 
-	movewindow(client->id, client->x, client->y);
+	movewindow(client);
 }
 
-void movewindow(xcb_drawable_t win, const uint32_t x, const uint32_t y)
-{ // Move window win to root coordinates x,y.
-	uint32_t values[2] = {x, y};
+void movewindow(Client* client)
+{ // Move window to root coordinates client->x,y.
+	markdirty(client, DIRTY_GEOMETRY);
+}
 
-	if (screen->root == win || 0 == win) return;
+/* Step through the windows shown on the current workspace: its own list
+ * followed by the fixed windows, wrapping around at either end. */
+auto ringstep(Client const* cl, bool forward) -> Client*
+{
+	auto const& own = wslists[curws];
+	auto const& fixed = wslists[FIXED_WS];
 
-	xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, values);
+	if (nullptr != cl && nullptr != (forward ? cl->ws_next : cl->ws_prev))
+		return forward ? cl->ws_next : cl->ws_prev;
 
-	xcb_flush(conn);
+	/* Move over to the other list, or wrap around this one if the
+	 * other one is empty. */
+	Wslist const* other;
+	if (nullptr != cl && cl->ws != FIXED_WS)
+		other = fixed.empty() ? &own : &fixed;
+	else
+		other = own.empty() ? &fixed : &own;
+	return forward ? other->front() : other->back();
 }
 
 void focusnext_helper(bool arg)
 {
 	Client* cl = nullptr;
-	if (wslists[curws].empty()) return;
-	// if no focus on current workspace, find first valid item on list.
-	if (nullptr == focuswin || focuswin->ws != curws) {
-		cl = *std::find_if_not(wslists[curws].cbegin(), wslists[curws].cend(),
-				       [](auto const& c) { return c->iconic; });
-	} else {
-		if (arg) {
-			// start from focus next and find first valid item on circular list.
-			// do {
-			cl = *std::rotate(wslists[curws].begin(), std::next(wslists[curws].begin()),
-					  wslists[curws].end());
-			// } while (!cl->iconic);
-		} else {
-			// start from focus previous and find first valid on circular list.
-			// do {
-			cl = *std::rotate(wslists[curws].rbegin(),
-					  std::next(wslists[curws].rbegin()),
-					  wslists[curws].rend());
-			//} while (!cl->iconic);
-		}
-	}
+	size_t shown = wslists[curws].size() + wslists[FIXED_WS].size();
+	if (shown == 0) return;
+	// if no focus on current workspace, start from either end of the ring.
+	if (nullptr != focuswin && onworkspace(focuswin, curws)) cl = focuswin;
+	// find the next window on the ring that isn't iconified.
+	do {
+		cl = ringstep(cl, arg);
+	} while (cl->iconic && --shown > 0);
+	if (cl->iconic) return;
 	raisewindow(cl->id);
 	centerpointer(cl->id, cl);
 	setfocus(cl);
@@ -1416,11 +2769,8 @@ void setfocus(Client const* client) // Set focus on window client.
 	if (nullptr == client) {
 		focuswin = nullptr;
 		xcb_set_input_focus(conn, XCB_NONE, XCB_INPUT_FOCUS_POINTER_ROOT, XCB_CURRENT_TIME);
-		xcb_window_t not_win = 0;
-		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root,
-				    ewmh->_NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW, 32, 1, &not_win);
-
-		xcb_flush(conn);
+		requests_asked++;
+		activewin = XCB_NONE;
 		return;
 	}
 
@@ -1434,14 +2784,14 @@ void setfocus(Client const* client) // Set focus on window client.
 			    ewmh->_NET_WM_STATE, 32, 2, data);
 	xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, client->id,
 			    XCB_CURRENT_TIME); /* Set new input focus. */
-	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, ewmh->_NET_ACTIVE_WINDOW,
-			    XCB_ATOM_WINDOW, 32, 1, &client->id);
+	requests_asked++;
+	activewin = client->id;
 
 	/* Remember the new window as the current focused window. */
 	focuswin = const_cast<Client*>(client);
 
 	grabbuttons(client);
-	setborders(client, true);
+	setborders(focuswin, true);
 }
 
 void start(const Arg* arg)
@@ -1475,34 +2825,18 @@ void resizelim(Client* client)
 	if (client->y + client->height + bw > mon_y + mon_height)
 		client->height = mon_height - ((client->y - mon_y) + bw * 2);
 
-	resize(client->id, client->width, client->height);
+	resize(client);
 }
 
-void moveresize(xcb_drawable_t win, const uint16_t x, const uint16_t y, const uint16_t width,
-		const uint16_t height)
+void moveresize(Client* client)
 {
-	uint32_t values[4] = {x, y, width, height};
-
-	if (screen->root == win || 0 == win) return;
-
-	xcb_configure_window(conn, win,
-			     XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-				     XCB_CONFIG_WINDOW_HEIGHT,
-			     values);
-
-	xcb_flush(conn);
+	markdirty(client, DIRTY_GEOMETRY);
 }
 
-/* Resize window win to width,height. */
-void resize(xcb_drawable_t win, const uint16_t width, const uint16_t height)
+/* Resize window to client->width,height. */
+void resize(Client* client)
 {
-	uint32_t values[2] = {width, height};
-
-	if (screen->root == win || 0 == win) return;
-
-	xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
-
-	xcb_flush(conn);
+	markdirty(client, DIRTY_GEOMETRY);
 }
 
 /* Resize window client in direction. */
@@ -1561,56 +2895,40 @@ void resizestep_aspect(const Arg* arg)
 	setborders(focuswin, true);
 }
 
-/* Try to snap to other windows and monitor border */
-void snapwindow(Client* client)
+/* Collect the edges of every other window shown on the current workspace. */
+void buildsnapindex(Client const* client)
 {
-	int16_t mon_x, mon_y;
-	uint16_t mon_width, mon_height;
-
-	getmonsize(1, &mon_x, &mon_y, &mon_width, &mon_height, focuswin);
+	snapindex.clear();
+	/* Fixed windows are shown on this workspace too. */
+	for (auto ws : {size_t{curws}, FIXED_WS})
+		for (auto const& win : wslists[ws])
+			if (client != win) snapindex.add(win, borderwidth);
+	snapindex.sort();
+}
 
-	for (auto const& win : wslists[curws]) {
-		if (client != win) {
-			if (abs((win->x + win->width) - client->x + borderwidth) < magnet_border)
-				if (client->y + client->height > win->y &&
-				    client->y < win->y + win->height)
-					client->x = (win->x + win->width) + (2 * borderwidth);
-
-			if (abs((win->y + win->height) - client->y + borderwidth) < magnet_border)
-				if (client->x + client->width > win->x &&
-				    client->x < win->x + win->width)
-					client->y = (win->y + win->height) + (2 * borderwidth);
-
-			if (abs((client->x + client->width) - win->x + borderwidth) < magnet_border)
-				if (client->y + client->height > win->y &&
-				    client->y < win->y + win->height)
-					client->x = (win->x - client->width) - (2 * borderwidth);
-
-			if (abs((client->y + client->height) - win->y + borderwidth) <
-			    magnet_border)
-				if (client->x + client->width > win->x &&
-				    client->x < win->x + win->width)
-					client->y = (win->y - client->height) - (2 * borderwidth);
-		}
-	}
+/* Try to snap to the other windows, using the index built when the drag
+ * started. */
+void snapwindow(Client* client)
+{
+	snapindex.snap(client, magnet_border, borderwidth);
 }
 
-/* Move window win as a result of pointer motion to coordinates rel_x,rel_y. */
-void mousemove(const int16_t rel_x, const int16_t rel_y)
+/* Move window client as a result of pointer motion to coordinates rel_x,rel_y. */
+void mousemove(Client* client, const int16_t rel_x, const int16_t rel_y)
 {
-	if (focuswin == nullptr || focuswin->ws != curws) return;
+	if (!onworkspace(client, curws)) return;
 
-	focuswin->x = rel_x;
-	focuswin->y = rel_y;
+	client->x = rel_x;
+	client->y = rel_y;
 
-	if constexpr (magnet_border > 0) snapwindow(focuswin);
+	if constexpr (magnet_border > 0) snapwindow(client);
 
-	movelim(focuswin);
+	movelim(client);
 }
 
 void mouseresize(Client* client, const int16_t rel_x, const int16_t rel_y)
 {
-	if (focuswin->id == screen->root || focuswin->maxed) return;
+	if (client->maxed) return;
 
 	client->width = abs(rel_x);
 	client->height = abs(rel_y);
@@ -1650,91 +2968,131 @@ void movestep(const Arg* arg)
 	raise_current_window();
 	movelim(focuswin);
 	movepointerback(start_x, start_y, focuswin);
-	xcb_flush(conn);
 }
 
-void setborders(Client const* client, const bool isitfocused)
+/* Repaint the border of client when the state is next committed. */
+void setborders(Client* client, const bool isitfocused)
 {
-	uint32_t values[1]; /* this is the color maintainer */
+	client->focusborder = isitfocused;
+	markdirty(client, DIRTY_BORDER);
+}
 
-	if (client->maxed || client->ignore_borders) return;
+/* The graphics context to paint borders at depth with, created on first use on d. */
+auto bordergc(uint8_t depth, xcb_drawable_t d) -> xcb_gcontext_t
+{
+	for (auto [gcdepth, gc] : bordergcs)
+		if (gcdepth == depth) return gc;
 
-	// Set border width.
-	values[0] = borderwidth;
-	xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
+	xcb_gcontext_t gc = xcb_generate_id(conn);
+	xcb_create_gc(conn, gc, d, 0, nullptr);
+	bordergcs.emplace_back(depth, gc);
+	return gc;
+}
 
-	xcb_rectangle_t rect_inner[] = {
-		{static_cast<int16_t>(client->width), 0,
-		 static_cast<uint16_t>(borderwidth - outer_border),
-		 static_cast<uint16_t>(client->height + borderwidth - outer_border)},
-		{static_cast<int16_t>(client->width + borderwidth + outer_border), 0,
-		 static_cast<uint16_t>(borderwidth - outer_border),
-		 static_cast<uint16_t>(client->height + borderwidth - outer_border)},
-		{0, static_cast<int16_t>(client->height),
-		 static_cast<uint16_t>(client->width + borderwidth - outer_border),
-		 static_cast<uint16_t>(borderwidth - outer_border)},
-		{0, static_cast<int16_t>(client->height + borderwidth + outer_border),
-		 static_cast<uint16_t>(client->width + borderwidth - outer_border),
-		 static_cast<uint16_t>(borderwidth - outer_border)},
-		{static_cast<int16_t>(client->width + borderwidth + outer_border),
-		 static_cast<int16_t>(borderwidth + client->height + outer_border),
-		 static_cast<uint16_t>(borderwidth), static_cast<uint16_t>(borderwidth)}};
+/* Paint tile for key, on d. The tile is at least as large as the window with
+ * its border: the right and bottom strips are painted just past the window,
+ * the left and top ones at the far end of the pixmap where the tile wraps
+ * around to them. Only those strips are ever shown, so a repaint only fills
+ * them, whatever the window's size, and the pixmap can be kept for as long as
+ * the window fits in it. The caller makes sure the tile isn't shown. */
+void painttile(Bordertile& tile, Borderkey const& key, xcb_drawable_t d)
+{
+	uint16_t const w = key.width, h = key.height;
+	auto const need_w = std::min<uint32_t>(w + borderwidth * 2, UINT16_MAX);
+	auto const need_h = std::min<uint32_t>(h + borderwidth * 2, UINT16_MAX);
+
+	/* Grow in steps so that resizing doesn't reallocate all the time, and
+	 * give memory back once the window shrank to less than half of it. */
+	if (XCB_NONE == tile.pmap || tile.key.depth != key.depth || tile.width < need_w ||
+	    tile.height < need_h ||
+	    uint64_t{tile.width} * tile.height > uint64_t{need_w} * need_h * 2 + 65536) {
+		if (XCB_NONE != tile.pmap) xcb_free_pixmap(conn, tile.pmap);
+		tile.pmap = xcb_generate_id(conn);
+		tile.width = std::min<uint32_t>((need_w + 63) & ~63u, UINT16_MAX);
+		tile.height = std::min<uint32_t>((need_h + 63) & ~63u, UINT16_MAX);
+		xcb_create_pixmap(conn, key.depth, tile.pmap, d, tile.width, tile.height);
+		if constexpr (print_stats)
+			fprintf(stderr, "2bwm: border tile of 0x%x is now %ux%u\n", d, tile.width,
+				tile.height);
+	}
+
+	int16_t const tw = tile.width, th = tile.height;
+	uint16_t const in = borderwidth - outer_border; // Inner band, next to the window.
 
+	/* The outer bands run through the corners, the inner ones stop at them. */
 	xcb_rectangle_t rect_outer[] = {
-		{static_cast<int16_t>(client->width + borderwidth - outer_border), 0, outer_border,
-		 static_cast<uint16_t>(client->height + borderwidth * 2)},
-		{static_cast<int16_t>(client->width + borderwidth), 0, outer_border,
-		 static_cast<uint16_t>(client->height + borderwidth * 2)},
-		{0, static_cast<int16_t>(client->height + borderwidth - outer_border),
-		 static_cast<uint16_t>(client->width + borderwidth * 2), outer_border},
-		{0, static_cast<int16_t>(client->height + borderwidth),
-		 static_cast<uint16_t>(client->width + borderwidth * 2), outer_border},
-		{1, 1, 1, 1}};
-
-	xcb_pixmap_t pmap = xcb_generate_id(conn);
-	xcb_create_pixmap(conn, client->depth, pmap, client->id, client->width + (borderwidth * 2),
-			  client->height + (borderwidth * 2));
+		{static_cast<int16_t>(w + in), 0, outer_border, tile.height},
+		{static_cast<int16_t>(tw - borderwidth), 0, outer_border, tile.height},
+		{0, static_cast<int16_t>(h + in), tile.width, outer_border},
+		{0, static_cast<int16_t>(th - borderwidth), tile.width, outer_border}};
 
-	xcb_gcontext_t gc = xcb_generate_id(conn);
-	xcb_create_gc(conn, gc, pmap, 0, nullptr);
+	xcb_rectangle_t rect_inner[] = {
+		{static_cast<int16_t>(w), 0, in, static_cast<uint16_t>(h + in)},
+		{static_cast<int16_t>(w), static_cast<int16_t>(th - in), in, in},
+		{static_cast<int16_t>(tw - in), 0, in, static_cast<uint16_t>(h + in)},
+		{static_cast<int16_t>(tw - in), static_cast<int16_t>(th - in), in, in},
+		{0, static_cast<int16_t>(h), w, in},
+		{0, static_cast<int16_t>(th - in), w, in}};
 
-	if ((top_win != 0 && client->id == top_win) ^ inverted_colors) {
-		xcb_rectangle_t fake_rect[5];
+	std::span<xcb_rectangle_t const> outer_rects{rect_outer}, inner_rects{rect_inner};
 
-		for (uint8_t i = 0; i < 5; i++) {
-			fake_rect[i] = rect_outer[i];
-			rect_outer[i] = rect_inner[i];
-			rect_inner[i] = fake_rect[i];
-		}
-	}
+	if (key.top ^ inverted_colors) std::swap(outer_rects, inner_rects);
 
-	values[0] = outerbordercol;
+	uint32_t outer = outerbordercol;
 
-	if (client->unkillable || client->fixed) {
-		if (client->unkillable && client->fixed)
-			values[0] = fixedunkilcol;
-		else if (client->fixed)
-			values[0] = fixedcol;
+	if (key.unkillable || key.fixed) {
+		if (key.unkillable && key.fixed)
+			outer = fixedunkilcol;
+		else if (key.fixed)
+			outer = fixedcol;
 		else
-			values[0] = unkilcol;
+			outer = unkilcol;
 	}
 
-	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &values[0]);
-	xcb_poly_fill_rectangle(conn, pmap, gc, 5, rect_outer);
+	uint32_t const inner = key.focused ? focuscol : unfocuscol;
 
-	values[0] = focuscol;
+	xcb_gcontext_t gc = bordergc(key.depth, tile.pmap);
+	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &outer);
+	xcb_poly_fill_rectangle(conn, tile.pmap, gc, outer_rects.size(), outer_rects.data());
+	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &inner);
+	xcb_poly_fill_rectangle(conn, tile.pmap, gc, inner_rects.size(), inner_rects.data());
+	tile.key = key;
+}
 
-	if (!isitfocused) values[0] = unfocuscol;
+/* Set the border of client to show its size and colours. A client keeps a
+ * tile for each of the last two looks it had, so switching the focus back
+ * and forth only sets the other tile. The tile that is set is never painted
+ * into. Returns whether anything was sent: nothing is when the border would
+ * look the same as it does, or when the window isn't shown, in which case it
+ * is painted when the window is mapped again. */
+auto drawborders(Client* client) -> bool
+{
+	uint32_t values[1]; /* this is the color maintainer */
 
-	xcb_change_gc(conn, gc, XCB_GC_FOREGROUND, &values[0]);
-	xcb_poly_fill_rectangle(conn, pmap, gc, 5, rect_inner);
-	values[0] = pmap;
-	xcb_change_window_attributes(conn, client->id, XCB_CW_BORDER_PIXMAP, &values[0]);
+	if (client->maxed || client->ignore_borders) return false;
+	if (client->iconic || !onworkspace(client, curws)) return false;
 
-	/* free the memory we allocated for the pixmap */
-	xcb_free_pixmap(conn, pmap);
-	xcb_free_gc(conn, gc);
-	xcb_flush(conn);
+	Borderkey const key{client->width,       client->height, client->depth,
+			    client->focusborder, client->fixed,  client->unkillable,
+			    client->layer == LAYER_ABOVE};
+	if (key == client->painted) return false;
+
+	// Set border width.
+	values[0] = borderwidth;
+	xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
+
+	auto& tiles = client->bordertiles;
+	uint8_t show = 1 - client->bordershown;
+	for (uint8_t i = 0; i < tiles.size(); i++)
+		if (XCB_NONE != tiles[i].pmap && tiles[i].key == key) show = i;
+	if (XCB_NONE == tiles[show].pmap || tiles[show].key != key)
+		painttile(tiles[show], key, client->id);
+
+	values[0] = tiles[show].pmap;
+	xcb_change_window_attributes(conn, client->id, XCB_CW_BORDER_PIXMAP, &values[0]);
+	client->bordershown = show;
+	client->painted = key;
+	return true;
 }
 
 void unmax(Client* client)
@@ -1746,8 +3104,9 @@ void unmax(Client* client)
 	client->width = client->origsize.width;
 	client->height = client->origsize.height;
 
-	client->maxed = client->hormaxed = false;
-	moveresize(client->id, client->x, client->y, client->width, client->height);
+	client->maxed = client->hormaxed = client->isfullscreen = false;
+	restack_due = true;
+	moveresize(client);
 
 	centerpointer(client->id, client);
 	setborders(client, true);
@@ -1789,15 +3148,14 @@ void maxwin(Client* client, uint8_t with_offsets)
 	maximize_helper(client, mon_x, mon_y, mon_width, mon_height);
 	raise_current_window();
 	if (!with_offsets) {
+		client->isfullscreen = restack_due = true;
 		xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id, ewmh->_NET_WM_STATE,
 				    XCB_ATOM_ATOM, 32, 1, &ewmh->_NET_WM_STATE_FULLSCREEN);
 	}
-	xcb_flush(conn);
 }
 
 void maxvert_hor(const Arg* arg)
 {
-	uint32_t values[2];
 	int16_t mon_y, mon_x, temp = 0;
 	uint16_t mon_height, mon_width;
 
@@ -1823,21 +3181,13 @@ void maxvert_hor(const Arg* arg)
 		focuswin->height = mon_height - (bw * 2);
 
 		/* Move to top of screen and resize. */
-		values[0] = focuswin->y;
-		values[1] = focuswin->height;
-
-		xcb_configure_window(conn, focuswin->id,
-				     XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_HEIGHT, values);
+		moveresize(focuswin);
 
 		focuswin->vertmaxed = true;
 	} else if (arg->i == TWOBWM_MAXIMIZE_HORIZONTALLY) {
 		focuswin->x = mon_x;
 		focuswin->width = mon_width - (bw * 2);
-		values[0] = focuswin->x;
-		values[1] = focuswin->width;
-
-		xcb_configure_window(conn, focuswin->id,
-				     XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_WIDTH, values);
+		moveresize(focuswin);
 
 		focuswin->hormaxed = true;
 	}
@@ -1894,7 +3244,7 @@ void maxhalf(const Arg* arg)
 		}
 	}
 
-	moveresize(focuswin->id, focuswin->x, focuswin->y, focuswin->width, focuswin->height);
+	moveresize(focuswin);
 
 	focuswin->verthor = true;
 	raise_current_window();
@@ -1916,14 +3266,13 @@ void hide()
 	xcb_unmap_window(conn, focuswin->id);
 	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, focuswin->id, ewmh->_NET_WM_STATE,
 			    ewmh->_NET_WM_STATE, 32, 3, data);
-
-	xcb_flush(conn);
 }
 
 auto getpointer(const xcb_drawable_t* win, int16_t* x, int16_t* y) -> bool
 {
 	xcb_query_pointer_reply_t* pointer;
 
+	roundtrips++;
 	pointer = xcb_query_pointer_reply(conn, xcb_query_pointer(conn, *win), nullptr);
 	if (nullptr == pointer) return false;
 	*x = pointer->win_x;
@@ -1933,30 +3282,12 @@ auto getpointer(const xcb_drawable_t* win, int16_t* x, int16_t* y) -> bool
 	return true;
 }
 
-auto getgeom(const xcb_drawable_t* win, int16_t* x, int16_t* y, uint16_t* width, uint16_t* height,
-	     uint8_t* depth) -> bool
-{
-	xcb_get_geometry_reply_t* geom =
-		xcb_get_geometry_reply(conn, xcb_get_geometry(conn, *win), nullptr);
-
-	if (nullptr == geom) return false;
-
-	*x = geom->x;
-	*y = geom->y;
-	*width = geom->width;
-	*height = geom->height;
-	*depth = geom->depth;
-
-	free(geom);
-	return true;
-}
-
 void teleport(const Arg* arg)
 {
 	int16_t pointx, pointy, mon_x, mon_y, temp = 0;
 	uint16_t mon_width, mon_height;
 
-	if (nullptr == focuswin || wslists[curws].empty() || focuswin->maxed) return;
+	if (nullptr == focuswin || !onworkspace(focuswin, curws) || focuswin->maxed) return;
 
 	if (!getpointer(&focuswin->id, &pointx, &pointy)) return;
 	uint16_t tmp_x = focuswin->x;
@@ -2002,10 +3333,9 @@ void teleport(const Arg* arg)
 		}
 	}
 
-	movewindow(focuswin->id, focuswin->x, focuswin->y);
+	movewindow(focuswin);
 	movepointerback(pointx, pointy, focuswin);
 	raise_current_window();
-	xcb_flush(conn);
 }
 
 void deletewin()
@@ -2019,8 +3349,6 @@ void deletewin()
 	/* Check if WM_DELETE is supported.  */
 	cookie = xcb_icccm_get_wm_protocols_unchecked(conn, focuswin->id, ewmh->WM_PROTOCOLS);
 
-	if (focuswin->id == top_win) top_win = 0;
-
 	if (xcb_icccm_get_wm_protocols_reply(conn, cookie, &protocols, nullptr) == 1) {
 		for (uint32_t i = 0; i < protocols.atoms_len; i++)
 			if (protocols.atoms[i] == ATOM[wm_delete_window]) {
@@ -2100,21 +3428,12 @@ void cursor_move(const Arg* arg)
 		xcb_warp_pointer(conn, XCB_NONE, XCB_NONE, 0, 0, 0, 0, speed, 0);
 	else if (cases == TWOBWM_CURSOR_LEFT)
 		xcb_warp_pointer(conn, XCB_NONE, XCB_NONE, 0, 0, 0, 0, -speed, 0);
-
-	xcb_flush(conn);
 }
 
 /* wrapper to get xcb keysymbol from keycode */
 static auto xcb_get_keysym(xcb_keycode_t keycode) -> xcb_keysym_t
 {
-	xcb_key_symbols_t* keysyms;
-
-	if (!(keysyms = xcb_key_symbols_alloc(conn))) return 0;
-
-	xcb_keysym_t keysym = xcb_key_symbols_get_keysym(keysyms, keycode, 0);
-	xcb_key_symbols_free(keysyms);
-
-	return keysym;
+	return xcb_key_symbols_get_keysym(keysyms.get(), keycode, 0);
 }
 
 void circulaterequest(xcb_generic_event_t* ev)
@@ -2133,15 +3452,9 @@ void handle_keypress(xcb_generic_event_t* e)
 {
 	auto* ev = (xcb_key_press_event_t*)e;
 	xcb_keysym_t keysym = xcb_get_keysym(ev->detail);
+	auto i = keytable.find(bindkey(keysym, cleanmask(ev->state, numlockmask)));
 
-	for (auto const& key : keys) {
-		if (keysym == key.keysym &&
-		    cleanmask(key.mod, numlockmask) == cleanmask(ev->state, numlockmask) &&
-		    key.func) {
-			key.func(&key.arg);
-			break;
-		}
-	}
+	if (i < std::size(keys) && keys[i].func) keys[i].func(&keys[i].arg);
 }
 
 /* Helper function to configure a window. */
@@ -2189,7 +3502,6 @@ void configwin(xcb_window_t win, uint16_t mask, const struct Winconf* wc)
 	if (i == -1) return;
 
 	xcb_configure_window(conn, win, mask, values);
-	xcb_flush(conn);
 }
 
 void configurerequest(xcb_generic_event_t* ev)
@@ -2197,13 +3509,8 @@ void configurerequest(xcb_generic_event_t* ev)
 	auto* e = (xcb_configure_request_event_t*)ev;
 	Client* client;
 	struct Winconf wc;
-	int16_t mon_x, mon_y;
-	uint16_t mon_width, mon_height;
-	uint32_t values[1];
 
 	if ((client = const_cast<Client*>(findclient(&e->window)))) { /* Find the client. */
-		getmonsize(1, &mon_x, &mon_y, &mon_width, &mon_height, client);
-
 		if (e->value_mask & XCB_CONFIG_WINDOW_WIDTH)
 			if (!client->maxed && !client->hormaxed) client->width = e->width;
 
@@ -2216,23 +3523,35 @@ void configurerequest(xcb_generic_event_t* ev)
 		if (e->value_mask & XCB_CONFIG_WINDOW_Y)
 			if (!client->maxed && !client->vertmaxed) client->y = e->y;
 
-		/* XXX Do we really need to pass on sibling and stack mode
-		 * configuration? Do we want to? */
-		if (e->value_mask & XCB_CONFIG_WINDOW_SIBLING) {
-			values[0] = e->sibling;
-			xcb_configure_window(conn, e->window, XCB_CONFIG_WINDOW_SIBLING, values);
-		}
-
+		/* Clients only get to move within their layer, a sibling is ignored. */
 		if (e->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
-			values[0] = e->stack_mode;
-			xcb_configure_window(conn, e->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
+			if (e->stack_mode == XCB_STACK_MODE_ABOVE)
+				raisewindow(client->id);
+			else if (e->stack_mode == XCB_STACK_MODE_BELOW)
+				lowerwindow(client->id);
 		}
 
-		/* Check if window fits on screen after resizing. */
+		/* Fit what was asked for on its monitor, it is written once by commit(). */
 		if (!client->maxed) {
-			resizelim(client);
-			movelim(client);
-			fitonscreen(client);
+			updatemonitor(client);
+			Sizepos const want{client->x, client->y, client->width, client->height};
+			auto const fit = constrain(want, getconstraints(client));
+			auto const& geom = fit.geom;
+
+			client->vertmaxed = client->hormaxed = false;
+			if (fit.maximize) {
+				client->x = geom.x;
+				client->y = geom.y;
+				client->width = geom.width - borderwidth * 2;
+				client->height = geom.height - borderwidth * 2;
+				maximize_helper(client, geom.x, geom.y, geom.width, geom.height);
+			} else {
+				client->x = geom.x;
+				client->y = geom.y;
+				client->width = geom.width;
+				client->height = geom.height;
+			}
+			markdirty(client, DIRTY_CONFIGURE);
 		}
 
 		setborders(client, true);
@@ -2249,12 +3568,9 @@ void configurerequest(xcb_generic_event_t* ev)
 	}
 }
 
-auto Create_Font_Cursor(xcb_connection_t* conn, uint16_t glyph) -> xcb_cursor_t
+auto Create_Font_Cursor(xcb_connection_t* conn, xcb_font_t cursor_font, uint16_t glyph)
+	-> xcb_cursor_t
 {
-	static xcb_font_t cursor_font;
-
-	cursor_font = xcb_generate_id(conn);
-	xcb_open_font(conn, cursor_font, strlen("cursor"), "cursor");
 	xcb_cursor_t cursor = xcb_generate_id(conn);
 	xcb_create_glyph_cursor(conn, cursor, cursor_font, cursor_font, glyph, glyph + 1, 0x3232,
 				0x3232, 0x3232, 0xeeee, 0xeeee, 0xeeec);
@@ -2262,7 +3578,22 @@ auto Create_Font_Cursor(xcb_connection_t* conn, uint16_t glyph) -> xcb_cursor_t
 	return cursor;
 }
 
-auto create_back_win() -> std::unique_ptr<Client>
+/* Create the cursors and the preview window drags use, so starting one
+ * creates nothing. */
+void setupdrag()
+{
+	xcb_font_t font = xcb_generate_id(conn);
+	xcb_open_font(conn, font, strlen("cursor"), "cursor");
+	dragcursors[TWOBWM_MOVE] = Create_Font_Cursor(conn, font, 52);    /* fleur */
+	dragcursors[TWOBWM_RESIZE] = Create_Font_Cursor(conn, font, 120); /* sizing */
+	/* The cursors keep what they need of it. */
+	xcb_close_font(conn, font);
+
+	create_back_win();
+}
+
+/* Create the preview, unmapped. Resizes move it over the window and map it. */
+void create_back_win()
 {
 	uint32_t values[1] = {focuscol};
 
@@ -2275,9 +3606,9 @@ auto create_back_win() -> std::unique_ptr<Client>
 			  /* parent window */
 			  screen->root,
 			  /* x, y */
-			  focuswin->x, focuswin->y,
+			  0, 0,
 			  /* width, height */
-			  focuswin->width, focuswin->height,
+			  1, 1,
 			  /* border width */
 			  resize_border,
 			  /* class */
@@ -2293,121 +3624,227 @@ auto create_back_win() -> std::unique_ptr<Client>
 		xcb_change_window_attributes(conn, id, XCB_CW_BACK_PIXEL, values);
 	}
 
-	return std::make_unique<Client>(
-		id, screen->width_in_pixels, screen->height_in_pixels, focuswin->x, focuswin->y,
-		focuswin->width, focuswin->height, focuswin->min_width, focuswin->min_height,
-		focuswin->width_inc, focuswin->height_inc, focuswin->base_width,
-		focuswin->base_height, focuswin->unkillable, focuswin->fixed, focuswin->monitor,
-		focuswin->ignore_borders);
+	preview.emplace(id, screen->width_in_pixels, screen->height_in_pixels);
+	preview->width = preview->height = 1;
+	preview->sent = {0, 0, 1, 1};
 }
 
+/* Start moving or resizing focuswin with the pointer. The drag goes on in
+ * run(), so everything else is still managed while it lasts. */
 void mousemotion(const Arg* arg)
 {
-	int16_t mx, my, winx, winy, winw, winh;
-	xcb_query_pointer_reply_t* pointer;
-	xcb_grab_pointer_reply_t* grab_reply;
-	xcb_motion_notify_event_t* ev = nullptr;
-	xcb_generic_event_t* e = nullptr;
-	bool ungrab;
+	if (drag) return;
 
-	pointer = xcb_query_pointer_reply(conn, xcb_query_pointer(conn, screen->root), nullptr);
+	auto pointer =
+		xcb_query_pointer_reply(conn, xcb_query_pointer(conn, screen->root), nullptr);
 
 	if (!pointer || focuswin->maxed) {
 		free(pointer);
 		return;
 	}
 
-	mx = pointer->root_x;
-	my = pointer->root_y;
-	winx = focuswin->x;
-	winy = focuswin->y;
-	winw = focuswin->width;
-	winh = focuswin->height;
-
-	xcb_cursor_t cursor;
-	std::unique_ptr<Client> example;
+	Drag d{.mode = arg->i,
+	       .client = focuswin->handle,
+	       .mx = pointer->root_x,
+	       .my = pointer->root_y,
+	       .px = pointer->root_x,
+	       .py = pointer->root_y,
+	       .winx = focuswin->x,
+	       .winy = focuswin->y,
+	       .winw = focuswin->width,
+	       .winh = focuswin->height};
+	free(pointer);
 	raise_current_window();
 
-	if (arg->i == TWOBWM_MOVE)
-		cursor = Create_Font_Cursor(conn, 52); /* fleur */
-	else {
-		cursor = Create_Font_Cursor(conn, 120); /* sizing */
-		example = create_back_win();
-		xcb_map_window(conn, example->id);
+	if (d.mode == TWOBWM_RESIZE && !opaque_resize) {
+		/* Lay the preview over the window, with its size hints. */
+		preview->x = focuswin->x;
+		preview->y = focuswin->y;
+		preview->width = focuswin->width;
+		preview->height = focuswin->height;
+		preview->max_width = screen->width_in_pixels;
+		preview->max_height = screen->height_in_pixels;
+		preview->min_width = focuswin->min_width;
+		preview->min_height = focuswin->min_height;
+		preview->width_inc = focuswin->width_inc;
+		preview->height_inc = focuswin->height_inc;
+		preview->base_width = focuswin->base_width;
+		preview->base_height = focuswin->base_height;
+		preview->monitor = focuswin->monitor;
+		preview->ignore_borders = focuswin->ignore_borders;
+		markdirty(&*preview, DIRTY_GEOMETRY);
+
+		uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+		xcb_configure_window(conn, preview->id, XCB_CONFIG_WINDOW_STACK_MODE, values);
+		xcb_map_window(conn, preview->id);
 	}
 
-	grab_reply =
+	auto grab_reply =
 		xcb_grab_pointer_reply(conn,
 				       xcb_grab_pointer(conn, 0, screen->root,
 							BUTTONMASK | XCB_EVENT_MASK_BUTTON_MOTION |
 								XCB_EVENT_MASK_POINTER_MOTION,
 							XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
-							XCB_NONE, cursor, XCB_CURRENT_TIME),
+							XCB_NONE, dragcursors[d.mode],
+							XCB_CURRENT_TIME),
 				       nullptr);
 
-	if (grab_reply->status != XCB_GRAB_STATUS_SUCCESS) {
+	if (nullptr == grab_reply || grab_reply->status != XCB_GRAB_STATUS_SUCCESS) {
 		free(grab_reply);
-
-		if (arg->i == TWOBWM_RESIZE) xcb_unmap_window(conn, example->id);
-
+		if (d.mode == TWOBWM_RESIZE && !opaque_resize) xcb_unmap_window(conn, preview->id);
 		return;
 	}
-
 	free(grab_reply);
-	ungrab = false;
-
-	do {
-		if (nullptr != e) free(e);
 
-		while (!(e = xcb_wait_for_event(conn))) xcb_flush(conn);
+	/* Follow the pointer once a frame of the monitor the window is on. */
+	d.timer = dragtimer(focuswin->monitor);
+	drag = std::move(d);
+}
 
-		switch (e->response_type & ~0x80) {
-		case XCB_CONFIGURE_REQUEST:
-		case XCB_MAP_REQUEST:
-			events[e->response_type & ~0x80](e);
-			break;
-		case XCB_MOTION_NOTIFY:
-			ev = (xcb_motion_notify_event_t*)e;
-			if (arg->i == TWOBWM_MOVE)
-				mousemove(winx + ev->root_x - mx, winy + ev->root_y - my);
-			else
-				mouseresize(example.get(), winw + ev->root_x - mx,
-					    winh + ev->root_y - my);
+/* Take ev if it is part of the drag: motion moves the pointer along, any key
+ * or button ends it. */
+auto dragevent(xcb_generic_event_t const* ev) -> bool
+{
+	switch (ev->response_type & ~0x80) {
+	case XCB_MOTION_NOTIFY: {
+		auto const* e = (xcb_motion_notify_event_t const*)ev;
+		/* Only the latest position matters once the frame comes. */
+		if (drag->pending) drag->dropped++;
+		drag->px = e->root_x;
+		drag->py = e->root_y;
+		drag->pending = true;
+		return true;
+	}
+	case XCB_KEY_PRESS:
+	case XCB_KEY_RELEASE:
+	case XCB_BUTTON_PRESS:
+	case XCB_BUTTON_RELEASE:
+		stopdrag(ev);
+		return true;
+	}
+	return false;
+}
 
-			xcb_flush(conn);
-			break;
-		case XCB_KEY_PRESS:
-		case XCB_KEY_RELEASE:
-		case XCB_BUTTON_PRESS:
-		case XCB_BUTTON_RELEASE:
-			if (arg->i == TWOBWM_RESIZE) {
-				ev = (xcb_motion_notify_event_t*)e;
+/* Move the window, or the outline of its new size, to where the pointer went. */
+void dragframe()
+{
+	auto client = winlist.get(drag->client);
 
-				mouseresize(focuswin, winw + ev->root_x - mx,
-					    winh + ev->root_y - my);
+	drag->pending = false;
+	if (nullptr == client) return;
+	drag->frames++;
+
+	int16_t const dx = drag->px - drag->mx, dy = drag->py - drag->my;
+	if (drag->mode == TWOBWM_MOVE) {
+		/* Other windows may have moved or appeared. */
+		if constexpr (magnet_border > 0)
+			if (drag->snapstale) buildsnapindex(client);
+		drag->snapstale = false;
+		mousemove(client, drag->winx + dx, drag->winy + dy);
+	} else {
+		/* The window itself follows in step with its redraws, see commitclient(). */
+		mouseresize(opaque_resize ? client : &*preview, drag->winw + dx, drag->winh + dy);
+	}
+}
 
-				setborders(focuswin, true);
-			}
+/* End the drag. With the event that ended it the window takes on where the
+ * pointer is, without one the window is gone and we only let go. */
+void stopdrag(xcb_generic_event_t const* ev)
+{
+	auto client = winlist.get(drag->client);
 
-			ungrab = true;
-			break;
+	if (nullptr != ev && nullptr != client) {
+		if (drag->mode == TWOBWM_RESIZE) {
+			auto const* e = (xcb_motion_notify_event_t const*)ev;
+			mouseresize(client, drag->winw + e->root_x - drag->mx,
+				    drag->winh + e->root_y - drag->my);
+			setborders(client, true);
+		} else if (drag->pending) {
+			dragframe();
 		}
-	} while (!ungrab && focuswin != nullptr);
+	}
 
-	free(pointer);
-	free(e);
-	xcb_free_cursor(conn, cursor);
+	if (drag->timer >= 0) close(drag->timer);
 	xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+	if (drag->mode == TWOBWM_RESIZE && !opaque_resize) xcb_unmap_window(conn, preview->id);
+
+	if constexpr (print_stats)
+		fprintf(stderr,
+			"2bwm: %s followed the pointer in %u frames, dropped %u superseded "
+			"motion samples, throttled %u frames for the client to draw%s\n",
+			drag->mode == TWOBWM_MOVE ? "move" : "resize", drag->frames,
+			drag->dropped, drag->throttled, nullptr == ev ? ", cancelled" : "");
+	drag.reset();
+}
 
-	if (arg->i == TWOBWM_RESIZE) xcb_unmap_window(conn, example->id);
+/* client moved, came or went, so the drag rebuilds snapindex before it snaps again. Moves
+ * and resizes come through markdirty(), windows that are mapped or go away are passed on by
+ * their handlers. The dragged window isn't in the index, its own changes don't count. */
+void snapchanged(Client const* client)
+{
+	if (drag && drag->client != client->handle) drag->snapstale = true;
+}
 
-	xcb_flush(conn);
+/* Wait for the next event. While a drag is paced by its timer, the frames
+ * that come due meanwhile are drawn, and sizes held back for clients that
+ * take too long to draw are sent once they stop waiting. */
+auto waitevent() -> xcb_generic_event_t*
+{
+	for (;;) {
+		bool const paced = drag && drag->timer >= 0;
+		auto const due = syncdue();
+		if (!paced && !due) return xcb_wait_for_event(conn);
+
+		if (auto e = xcb_poll_for_event(conn); nullptr != e) return e;
+		if (xcb_connection_has_error(conn) || 0 != sigcode) return nullptr;
+
+		int timeout = -1;
+		if (due) {
+			auto const left = std::chrono::ceil<std::chrono::milliseconds>(
+				*due - std::chrono::steady_clock::now());
+			timeout = std::max<int>(left.count(), 0);
+		}
+		pollfd fds[] = {{xcb_get_file_descriptor(conn), POLLIN, 0},
+				{paced ? drag->timer : -1, POLLIN, 0}};
+		poll(fds, 2, timeout);
+
+		uint64_t ticks;
+		bool const frame = paced && (fds[1].revents & POLLIN) &&
+				   read(drag->timer, &ticks, sizeof ticks) > 0 && drag->pending;
+		if (frame) dragframe();
+		if (frame || (due && std::chrono::steady_clock::now() >= *due)) {
+			commit();
+			xcb_flush(conn);
+		}
+	}
+}
+
+/* A timer that fires once a frame of mon, or at drag_rate if we don't know its
+ * refresh rate. -1 if there is none to be had, then drags aren't paced. */
+auto dragtimer(Monitor const* mon) -> int
+{
+	static_assert(drag_rate > 0, "drag_rate is a frequency in mHz");
+	uint32_t const mhz = nullptr != mon && mon->refresh >= 1000 ? mon->refresh : drag_rate;
+	int const fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) return -1;
+
+	uint64_t const ns = 1000000000000 / mhz;
+	timespec const period{static_cast<time_t>(ns / 1000000000),
+			      static_cast<long>(ns % 1000000000)};
+	itimerspec const every{period, period};
+	if (timerfd_settime(fd, 0, &every, nullptr) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
 }
 
 void buttonpress(xcb_generic_event_t* ev)
 {
 	auto* e = (xcb_button_press_event_t*)ev;
-	Client const* client;
+	Client* client;
 
 	if (!is_sloppy && e->detail == XCB_BUTTON_INDEX_1 &&
 	    cleanmask(e->state, numlockmask) == 0) {
@@ -2422,16 +3859,16 @@ void buttonpress(xcb_generic_event_t* ev)
 		return;
 	}
 
-	for (auto const& b : buttons)
-		if (b.func && b.button == e->detail &&
-		    cleanmask(b.mask, numlockmask) == cleanmask(e->state, numlockmask)) {
-			if ((focuswin == nullptr) && b.func == mousemotion) return;
-			if (b.root_only) {
-				if (e->event == e->root && e->child == 0) b.func(&(b.arg));
-			} else {
-				b.func(&(b.arg));
-			}
-		}
+	auto i = buttontable.find(bindkey(e->detail, cleanmask(e->state, numlockmask)));
+	if (i == std::size(buttons) || !buttons[i].func) return;
+
+	auto const& b = buttons[i];
+	if ((focuswin == nullptr) && b.func == mousemotion) return;
+	if (b.root_only) {
+		if (e->event == e->root && e->child == 0) b.func(&(b.arg));
+	} else {
+		b.func(&(b.arg));
+	}
 }
 
 void clientmessage(xcb_generic_event_t* ev)
@@ -2485,6 +3922,20 @@ void clientmessage(xcb_generic_event_t* ev)
 				break;
 			}
 		}
+		for (uint8_t const layer : {LAYER_ABOVE, LAYER_BELOW}) {
+			auto const atom = layer == LAYER_ABOVE ? ewmh->_NET_WM_STATE_ABOVE
+							       : ewmh->_NET_WM_STATE_BELOW;
+			if (e->data.data32[1] != atom && e->data.data32[2] != atom) continue;
+			bool const on = e->data.data32[0] == XCB_EWMH_WM_STATE_ADD ||
+					(e->data.data32[0] == XCB_EWMH_WM_STATE_TOGGLE &&
+					 cl->layer != layer);
+			if (on)
+				cl->layer = layer;
+			else if (cl->layer == layer)
+				cl->layer = LAYER_NORMAL;
+			restack_due = true;
+			setborders(cl, cl == focuswin);
+		}
 	} else if (e->type == ewmh->_NET_WM_DESKTOP && e->format == 32) {
 		cl = const_cast<Client*>(findclient(&e->window));
 		if (nullptr == cl) return;
@@ -2496,10 +3947,10 @@ void clientmessage(xcb_generic_event_t* ev)
 		 *
 		 * e->data.data32[0] new workspace
 		 */
+		if (cl->fixed || e->data.data32[0] >= WORKSPACES) return;
 		delfromworkspace(cl);
 		addtoworkspace(cl, e->data.data32[0]);
 		xcb_unmap_window(conn, cl->id);
-		xcb_flush(conn);
 	}
 }
 
@@ -2513,11 +3964,45 @@ void destroynotify(xcb_generic_event_t* ev)
 	cl = findclient(&e->window);
 
 	/* Find this window in list of clients and forget about it. */
-	if (nullptr != cl) forgetwin(cl->id);
+	if (nullptr != cl) {
+		snapchanged(cl);
+		forgetwin(cl->id);
+	}
 
+	unstack(e->window);
 	updateclientlist();
 }
 
+void createnotify(xcb_generic_event_t* ev)
+{
+	auto* e = (xcb_create_notify_event_t*)ev;
+
+	/* New windows start out on top of their siblings. */
+	if (e->parent == screen->root) stackontop(e->window);
+}
+
+void reparentnotify(xcb_generic_event_t* ev)
+{
+	auto* e = (xcb_reparent_notify_event_t*)ev;
+
+	if (e->event != screen->root) return;
+	if (e->parent == screen->root)
+		stackontop(e->window);
+	else
+		unstack(e->window);
+}
+
+void circulatenotify(xcb_generic_event_t* ev)
+{
+	auto* e = (xcb_circulate_notify_event_t*)ev;
+
+	if (e->event != screen->root) return;
+	if (e->place == XCB_PLACE_ON_BOTTOM)
+		stackabove(e->window, XCB_NONE);
+	else
+		stackontop(e->window);
+}
+
 void enternotify(xcb_generic_event_t* ev)
 {
 	auto* e = (xcb_enter_notify_event_t*)ev;
@@ -2592,8 +4077,9 @@ void unmapnotify(xcb_generic_event_t* ev)
 	 * ignore UnmapNotify on them.
 	 */
 	auto client = const_cast<Client*>(findclient(&e->window));
-	if (nullptr == client || client->ws != curws) return;
+	if (nullptr == client || !onworkspace(client, curws)) return;
 	if (focuswin != nullptr && client->id == focuswin->id) focuswin = nullptr;
+	snapchanged(client);
 	if (client->iconic == false) forgetclient(client);
 
 	updateclientlist();
@@ -2602,13 +4088,11 @@ void unmapnotify(xcb_generic_event_t* ev)
 void mapnotify(xcb_generic_event_t* ev)
 {
 	auto* e = (xcb_mapping_notify_event_t*)ev;
-	xcb_key_symbols_t* keysyms;
-	if (!(keysyms = xcb_key_symbols_alloc(conn))) return;
-	xcb_refresh_keyboard_mapping(keysyms, e);
-	xcb_key_symbols_free(keysyms);
+	if (e->request == XCB_MAPPING_POINTER) return;
 
-	setup_keyboard();
-	grabkeys();
+	/* Changing the layout sends a burst of these, run() regrabs once it is over. */
+	xcb_refresh_keyboard_mapping(keysyms.get(), e);
+	mappingnotifies++;
 }
 
 void confignotify(xcb_generic_event_t* ev)
@@ -2632,6 +4116,150 @@ void confignotify(xcb_generic_event_t* ev)
 
 			if (-1 == randrbase) arrangewindows();
 		}
+	} else if (e->event == screen->root) {
+		/* One of its children moved, its place in the stack comes along. */
+		stackabove(e->window, e->above_sibling);
+	}
+}
+
+/* Fold the fields of an earlier ConfigureRequest for the same window that e doesn't set
+ * into e, so e alone asks for everything both did. */
+void mergeconfigure(xcb_configure_request_event_t* e, xcb_configure_request_event_t const* old)
+{
+	uint16_t const missing = old->value_mask & ~e->value_mask;
+
+	if (missing & XCB_CONFIG_WINDOW_X) e->x = old->x;
+	if (missing & XCB_CONFIG_WINDOW_Y) e->y = old->y;
+	if (missing & XCB_CONFIG_WINDOW_WIDTH) e->width = old->width;
+	if (missing & XCB_CONFIG_WINDOW_HEIGHT) e->height = old->height;
+	if (missing & XCB_CONFIG_WINDOW_BORDER_WIDTH) e->border_width = old->border_width;
+	if (missing & XCB_CONFIG_WINDOW_SIBLING) e->sibling = old->sibling;
+	if (missing & XCB_CONFIG_WINDOW_STACK_MODE) e->stack_mode = old->stack_mode;
+	e->value_mask |= missing;
+}
+
+/* Add e to the batch, dropping the queued events it supersedes: an earlier
+ * ConfigureRequest for the same window is merged into it, and an earlier
+ * EnterNotify is pointless once the pointer entered somewhere else. Events
+ * are only folded within a run of one kind, so none of them is moved past
+ * an event of another kind. */
+void batchevent(xcb_generic_event_t* e)
+{
+	auto const type = e->response_type & ~0x80;
+	auto const enters = [](xcb_generic_event_t const* ev) {
+		auto mode = ((xcb_enter_notify_event_t const*)ev)->mode;
+		return mode == XCB_NOTIFY_MODE_NORMAL || mode == XCB_NOTIFY_MODE_UNGRAB;
+	};
+
+	if (!batch.empty() && (batch.back()->response_type & ~0x80) != type)
+		batch_scope = batch.size();
+	if (type != XCB_CONFIGURE_REQUEST && type != XCB_ENTER_NOTIFY) {
+		batch.push_back(e);
+		return;
+	}
+
+	for (auto i = batch.size(); i-- > batch_scope;) {
+		auto* old = batch[i];
+		if ((old->response_type & ~0x80) != type) continue;
+
+		if (type == XCB_CONFIGURE_REQUEST) {
+			auto* cr = (xcb_configure_request_event_t*)e;
+			auto const* oldcr = (xcb_configure_request_event_t const*)old;
+			if (oldcr->window != cr->window) continue;
+			mergeconfigure(cr, oldcr);
+			coalesced_configures++;
+		} else {
+			if (!enters(old) || !enters(e)) continue;
+			coalesced_enters++;
+		}
+		free(old);
+		batch.erase(batch.begin() + i);
+		break;
+	}
+	batch.push_back(e);
+}
+
+/* Whether input about wins has to wait for e: e may change which window has the focus or
+ * which workspace is shown, or is about one of wins itself. */
+auto holdsback(xcb_generic_event_t const* e, std::array<xcb_window_t, 2> const& wins) -> bool
+{
+	xcb_window_t win;
+
+	switch (e->response_type & ~0x80) {
+	case XCB_PROPERTY_NOTIFY:
+		win = ((xcb_property_notify_event_t const*)e)->window;
+		break;
+	case XCB_CONFIGURE_REQUEST:
+		win = ((xcb_configure_request_event_t const*)e)->window;
+		break;
+	case XCB_CONFIGURE_NOTIFY:
+		win = ((xcb_configure_notify_event_t const*)e)->window;
+		break;
+	case XCB_CIRCULATE_REQUEST:
+		win = ((xcb_circulate_request_event_t const*)e)->window;
+		break;
+	case XCB_UNMAP_NOTIFY:
+		win = ((xcb_unmap_notify_event_t const*)e)->window;
+		break;
+	case XCB_DESTROY_NOTIFY:
+		win = ((xcb_destroy_notify_event_t const*)e)->window;
+		break;
+	case XCB_CREATE_NOTIFY:
+		win = ((xcb_create_notify_event_t const*)e)->window;
+		break;
+	case XCB_REPARENT_NOTIFY:
+		win = ((xcb_reparent_notify_event_t const*)e)->window;
+		break;
+	case XCB_CIRCULATE_NOTIFY:
+		win = ((xcb_circulate_notify_event_t const*)e)->window;
+		break;
+	case XCB_CLIENT_MESSAGE: {
+		auto const* cm = (xcb_client_message_event_t const*)e;
+		if (cm->type == ewmh->_NET_ACTIVE_WINDOW || cm->type == ewmh->_NET_CURRENT_DESKTOP)
+			return true;
+		win = cm->window;
+		break;
+	}
+	default:
+		/* Other input, EnterNotify, MapRequest and anything we don't know. */
+		return true;
+	}
+	return std::ranges::find(wins, win) != wins.end();
+}
+
+/* Move the key presses, button presses and pointer motion of the batch ahead of the events
+ * queued before them that they don't depend on, so that a client flooding us doesn't make
+ * the bindings lag. Input keeps its own order. */
+void schedule()
+{
+	for (size_t i = 0; i < batch.size(); i++) {
+		auto const* e = batch[i];
+		std::array<xcb_window_t, 2> wins;
+
+		switch (e->response_type & ~0x80) {
+		case XCB_KEY_PRESS:
+			/* Key bindings act on the focused window. */
+			wins = {nullptr != focuswin ? focuswin->id : xcb_window_t{XCB_NONE},
+				XCB_NONE};
+			break;
+		case XCB_BUTTON_PRESS: {
+			auto const* b = (xcb_button_press_event_t const*)e;
+			wins = {b->event, b->child};
+			break;
+		}
+		case XCB_MOTION_NOTIFY: {
+			auto const* m = (xcb_motion_notify_event_t const*)e;
+			wins = {m->event, m->child};
+			break;
+		}
+		default:
+			continue;
+		}
+
+		auto j = i;
+		while (j > 0 && !holdsback(batch[j - 1], wins)) j--;
+		overtaken += i - j;
+		std::rotate(batch.begin() + j, batch.begin() + i, batch.begin() + i + 1);
 	}
 }
 
@@ -2641,22 +4269,61 @@ void run()
 
 	while (0 == sigcode) {
 		/* the WM is running */
+		if (mappingnotifies > 0 && !(ev = xcb_poll_for_event(conn))) {
+			/* No more keyboard changes queued. */
+			setup_keyboard();
+			grabkeys();
+		}
+		/* A drag without a timer follows the pointer whenever we caught up. */
+		if (drag && drag->pending && drag->timer < 0) dragframe();
+		commit();
 		xcb_flush(conn);
 
 		if (xcb_connection_has_error(conn)) {
 			cleanup();
 			abort();
 		}
-		if ((ev = xcb_wait_for_event(conn))) {
-			if (ev->response_type == randrbase + XCB_RANDR_SCREEN_CHANGE_NOTIFY)
-				getrandr();
-
-			if (events[ev->response_type & ~0x80])
-				events[ev->response_type & ~0x80](ev);
-
-			if (top_win != 0) raisewindow(top_win);
+		if (ev || (ev = waitevent())) {
+			/* Take along whatever else is already queued and handle it as one
+			 * batch, input first. A key or button press ends the batch, its
+			 * handler may read the events after it from the queue itself. */
+			for (; nullptr != ev; ev = xcb_poll_for_queued_event(conn)) {
+				batchevent(ev);
+				auto const type = ev->response_type & ~0x80;
+				if (type == XCB_KEY_PRESS || type == XCB_BUTTON_PRESS) break;
+			}
+			schedule();
+
+			for (auto* e : batch) {
+				ev = e;
+				if (ev->response_type == randrbase + XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+					getrandr();
+				if (-1 != syncbase &&
+				    (ev->response_type & ~0x80) == syncbase + XCB_SYNC_ALARM_NOTIFY)
+					syncnotify(ev);
+
+				if (drag && dragevent(ev)) {
+					free(ev);
+					continue;
+				}
+				if (events[ev->response_type & ~0x80])
+					events[ev->response_type & ~0x80](ev);
 
-			free(ev);
+				free(ev);
+			}
+			ev = nullptr;
+
+			if constexpr (print_stats)
+				if (coalesced_configures + coalesced_enters + overtaken > 0)
+					fprintf(stderr,
+						"2bwm: %zu events handled, coalesced %u configure "
+						"requests and %u enter notifies, input overtook "
+						"%u events\n",
+						batch.size(), coalesced_configures,
+						coalesced_enters, overtaken);
+			coalesced_configures = coalesced_enters = overtaken = 0;
+			batch.clear();
+			batch_scope = 0;
 		}
 	}
 	if (sigcode == SIGHUP) {
@@ -2665,23 +4332,24 @@ void run()
 	}
 }
 
-/* Get a defined atom from the X server. */
-auto getatom(const char* atom_name) -> xcb_atom_t
+/* Intern all atoms in atomnames, sending every request before waiting on
+ * the first reply. Nothing needs to be interned after this. */
+void internatoms()
 {
-	xcb_intern_atom_cookie_t atom_cookie =
-		xcb_intern_atom(conn, 0, strlen(atom_name), atom_name);
+	xcb_intern_atom_cookie_t cookies[NB_ATOMS];
 
-	xcb_intern_atom_reply_t* rep = xcb_intern_atom_reply(conn, atom_cookie, nullptr);
+	for (size_t i = 0; i < NB_ATOMS; i++)
+		cookies[i] = xcb_intern_atom(conn, 0, strlen(atomnames[i]), atomnames[i]);
 
-	/* XXX Note that we return 0 as an atom if anything goes wrong.
-	 * Might become interesting.*/
+	roundtrips++;
+	for (size_t i = 0; i < NB_ATOMS; i++) {
+		xcb_intern_atom_reply_t* rep = xcb_intern_atom_reply(conn, cookies[i], nullptr);
 
-	if (nullptr == rep) return 0;
-
-	xcb_atom_t atom = rep->atom;
-
-	free(rep);
-	return atom;
+		/* XXX Note that we use 0 as an atom if anything goes wrong.
+		 * Might become interesting.*/
+		ATOM[i] = (nullptr == rep) ? 0 : rep->atom;
+		free(rep);
+	}
 }
 
 /* set the given client to listen to button events (presses / releases) */
@@ -2758,18 +4426,24 @@ auto setup(int scrno) -> bool
 				  ewmh->WM_PROTOCOLS,
 				  ewmh->_NET_WM_STATE,
 				  ewmh->_NET_WM_STATE_DEMANDS_ATTENTION,
-				  ewmh->_NET_WM_STATE_FULLSCREEN};
+				  ewmh->_NET_WM_STATE_FULLSCREEN,
+				  ewmh->_NET_WM_STATE_ABOVE,
+				  ewmh->_NET_WM_STATE_BELOW};
 
 	xcb_ewmh_set_supported(ewmh.get(), scrno, sizeof net_atoms / sizeof net_atoms[0],
 			       net_atoms);
 
-	for (i = 0; i < NB_ATOMS; i++) ATOM[i] = getatom(atomnames[i][0]);
+	internatoms();
 
 	randrbase = setuprandr();
+	syncbase = setupsync();
 
 	if (!setupscreen()) return false;
 
-	if (!setup_keyboard()) return false;
+	keysyms.reset(xcb_key_symbols_alloc(conn));
+	if (!keysyms || !setup_keyboard()) return false;
+
+	setupdrag();
 
 	xcb_generic_error_t* error =
 		xcb_request_check(conn, xcb_change_window_attributes_checked(
@@ -2797,6 +4471,9 @@ auto setup(int scrno) -> bool
 	events[XCB_MAPPING_NOTIFY] = mapnotify;
 	events[XCB_CONFIGURE_NOTIFY] = confignotify;
 	events[XCB_CIRCULATE_REQUEST] = circulaterequest;
+	events[XCB_CREATE_NOTIFY] = createnotify;
+	events[XCB_REPARENT_NOTIFY] = reparentnotify;
+	events[XCB_CIRCULATE_NOTIFY] = circulatenotify;
 	events[XCB_BUTTON_PRESS] = buttonpress;
 	events[XCB_CLIENT_MESSAGE] = clientmessage;
 
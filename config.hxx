@@ -33,6 +33,19 @@ static constexpr bool inverted_colors{true};
 
 static constexpr bool enable_compton{false};
 
+// Window moves and resizes follow the pointer once per frame of the monitor.
+// Rate in mHz to use when RANDR doesn't tell the monitor's refresh rate.
+static constexpr uint32_t drag_rate{60000};
+// Resize the window itself while dragging instead of an outline of it.
+static constexpr bool opaque_resize{false};
+// Clients that support it draw each size before they get the next. Don't wait
+// longer than this many milliseconds for one to finish.
+static constexpr unsigned int sync_timeout{100};
+
+///---Statistics---///
+// Print counters about round trips and requests sent to the X server to stderr.
+static constexpr bool print_stats{false};
+
 ///---Cursor---///
 /* default position of the cursor:
  * correct values are:
@@ -99,13 +112,13 @@ static void toggle_sloppy(const Arg* arg)
 			.i = N                                                                     \
 		}                                                                                  \
 	}
-static Key keys[] = {
+static constexpr Key keys[] = {
 	/* modifier           key            function           argument */
 	// Focus to next/previous window
 	{MOD, XK_Tab, focusnext, {.i = TWOBWM_FOCUS_NEXT}},
 	{MOD | SHIFT, XK_Tab, focusnext, {.i = TWOBWM_FOCUS_PREVIOUS}},
 	// Kill a window
-	{MOD, XK_q, reinterpret_cast<void (*)(const Arg*)>(deletewin), {}},
+	{MOD, XK_q, noarg<deletewin>, {}},
 	// Resize a window
 	{MOD | SHIFT, XK_k, resizestep, {.i = TWOBWM_RESIZE_UP}},
 	{MOD | SHIFT, XK_j, resizestep, {.i = TWOBWM_RESIZE_DOWN}},
@@ -173,21 +186,21 @@ static Key keys[] = {
 	{MOD, XK_comma, changescreen, {.i = TWOBWM_NEXT_SCREEN}},
 	{MOD, XK_period, changescreen, {.i = TWOBWM_PREVIOUS_SCREEN}},
 	// Raise or lower a window
-	{MOD, XK_r, reinterpret_cast<void (*)(const Arg*)>(raiseorlower), {}},
+	{MOD, XK_r, noarg<raiseorlower>, {}},
 	// Next/Previous workspace
-	{MOD, XK_v, reinterpret_cast<void (*)(const Arg*)>(nextworkspace), {}},
-	{MOD, XK_c, reinterpret_cast<void (*)(const Arg*)>(prevworkspace), {}},
+	{MOD, XK_v, noarg<nextworkspace>, {}},
+	{MOD, XK_c, noarg<prevworkspace>, {}},
 	// Move to Next/Previous workspace
 	{MOD | SHIFT, XK_v, sendtonextworkspace, {}},
 	{MOD | SHIFT, XK_c, sendtoprevworkspace, {}},
 	// Iconify the window
-	{MOD, XK_i, reinterpret_cast<void (*)(const Arg*)>(hide), {}},
+	{MOD, XK_i, noarg<hide>, {}},
 	// Make the window unkillable
-	{MOD, XK_a, reinterpret_cast<void (*)(const Arg*)>(unkillable), {}},
+	{MOD, XK_a, noarg<unkillable>, {}},
 	// Make the window appear always on top
-	{MOD, XK_t, reinterpret_cast<void (*)(const Arg*)>(always_on_top), {}},
+	{MOD, XK_t, noarg<always_on_top>, {}},
 	// Make the window stay on all workspaces
-	{MOD, XK_f, reinterpret_cast<void (*)(const Arg*)>(fix), {}},
+	{MOD, XK_f, noarg<fix>, {}},
 	// Move the cursor
 	{MOD, XK_Up, cursor_move, {.i = TWOBWM_CURSOR_UP_SLOW}},
 	{MOD, XK_Down, cursor_move, {.i = TWOBWM_CURSOR_DOWN_SLOW}},
@@ -201,8 +214,8 @@ static Key keys[] = {
 	// Start programs
 	{MOD, XK_w, start, {.com = menucmd}},
 	// Exit or restart 2bwm
-	{MOD | CONTROL, XK_q, reinterpret_cast<void (*)(const Arg*)>(twobwm_exit), {.i = 0}},
-	{MOD | CONTROL, XK_r, reinterpret_cast<void (*)(const Arg*)>(twobwm_restart), {.i = 0}},
+	{MOD | CONTROL, XK_q, noarg<twobwm_exit>, {.i = 0}},
+	{MOD | CONTROL, XK_r, noarg<twobwm_restart>, {.i = 0}},
 	{MOD, XK_space, halfandcentered, {.i = 0}},
 	{MOD, XK_s, toggle_sloppy, {.com = sloppy_switch_cmd}},
 	// Change current workspace
@@ -217,10 +230,11 @@ static Key keys[] = {
 	DESKTOPCHANGE(XK_9, 8),
 	DESKTOPCHANGE(XK_0, 9)};
 // the last argument makes it a root window only event
-static Button buttons[] = {{MOD, XCB_BUTTON_INDEX_1, mousemotion, {.i = TWOBWM_MOVE}, false},
-			   {MOD, XCB_BUTTON_INDEX_3, mousemotion, {.i = TWOBWM_RESIZE}, false},
-			   {0, XCB_BUTTON_INDEX_3, start, {.com = menucmd}, true},
-			   {MOD | SHIFT, XCB_BUTTON_INDEX_1, changeworkspace, {.i = 0}, false},
-			   {MOD | SHIFT, XCB_BUTTON_INDEX_3, changeworkspace, {.i = 1}, false},
-			   {MOD | ALT, XCB_BUTTON_INDEX_1, changescreen, {.i = 1}, false},
-			   {MOD | ALT, XCB_BUTTON_INDEX_3, changescreen, {.i = 0}, false}};
+static constexpr Button buttons[] = {
+	{MOD, XCB_BUTTON_INDEX_1, mousemotion, {.i = TWOBWM_MOVE}, false},
+	{MOD, XCB_BUTTON_INDEX_3, mousemotion, {.i = TWOBWM_RESIZE}, false},
+	{0, XCB_BUTTON_INDEX_3, start, {.com = menucmd}, true},
+	{MOD | SHIFT, XCB_BUTTON_INDEX_1, changeworkspace, {.i = 0}, false},
+	{MOD | SHIFT, XCB_BUTTON_INDEX_3, changeworkspace, {.i = 1}, false},
+	{MOD | ALT, XCB_BUTTON_INDEX_1, changescreen, {.i = 1}, false},
+	{MOD | ALT, XCB_BUTTON_INDEX_3, changescreen, {.i = 0}, false}};